@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// protocol between the module and pam-dynamo-authd, over a unix stream socket on the same host
+// a request is a header followed by the module arguments, the username and the password, each a 16 bit length
+// and the bytes, the reply is the header with the result in place of the length, one request per connection
+
+const uint32_t kAuthdMagic = 0x31414450; // "PDA1"
+
+// largest request body the daemon will read
+const uint32_t kAuthdMaxRequest = 16384;
+
+struct AuthdHeader {
+  uint32_t magic;
+  // body length in a request, one of AuthdResult in the reply
+  uint32_t value;
+};
+
+enum AuthdResult {
+  AUTHD_SUCCESS,
+  AUTHD_FAILURE,
+  // the daemon could not be reached or did not answer, the caller should authenticate in process
+  AUTHD_UNAVAILABLE,
+  // rejected without asking the backend because the user has made too many calls recently
+  AUTHD_MAXTRIES
+};
+
+struct AuthdRequest {
+  std::vector<std::string> args;
+  std::string username;
+  std::string password;
+};
+
+// builds the body of a request, returns false if a field is too long to send
+bool authd_encode(const AuthdRequest& request, std::string& body);
+bool authd_decode(const char *body, size_t length, AuthdRequest& request);
+
+// the answer to send for one of AuthStatus
+int authd_result(int status);
+
+// reads or writes exactly length bytes, giving up on an error, a timeout (SO_RCVTIMEO/SO_SNDTIMEO) or end of file
+bool authd_read(int fd, void *buffer, size_t length);
+bool authd_write(int fd, const void *buffer, size_t length);
+
+// asks the daemon listening on socket_path, waiting at most timeout_ms for the answer, returns one of AuthdResult
+// a daemon not running as root or as this process's user is not trusted and counts as unavailable, as does one
+// which cannot be reached or closes the connection, but one which has the request and does not answer in time is a
+// failure, since it is still looking the user up
+int authd_authenticate(const std::string& socket_path, int timeout_ms, int argc, const char **argv,
+                       const std::string& username, const std::string& password);
\ No newline at end of file
@@ -1,16 +1,70 @@
 #include <iostream>
+#include <utility>
+#include <vector>
+
+#include "CacheRecord.h"
+#include "Options.h"
+#include "ProcessCache.h"
+#include "ShmCache.h"
+
+struct CacheDb;
+
+// the folder, table and region a cache's entries come from, caches with different scopes never see each other's
+// entries in shared memory, the process cache or the write queue even when they use the same realm
+std::string cache_scope(const std::string& directory, const Options& opts);
 
 class Cache {
   private:
     std::string realm;
     std::string directory;
     int session_duration;
+    // one connection per shard, opened on first use
+    std::vector<CacheDb*> dbs;
+    // see cache_scope
+    std::string scope;
+    ProcessCache local;
+    ShmCache shm;
+    Options opts;
+
+    int shard_for(const std::string& username);
+    CacheDb *open_shard(int shard);
+    // the connection for the shard holding username, NULL if it could not be opened
+    CacheDb *open(const std::string& username);
+    // writes a new record to the shared memory cache, removing the key instead if it could not be written
+    void share(const std::string& username, const CacheRecord& record);
+    // seconds after a save this caller may still use a row, kept in the row for the sweep
+    int keep_for();
   
   public:
-    Cache(std::string realm, std::string directory, int session_duration);
+    Cache(std::string realm, std::string directory, int session_duration, Options opts = Options());
     bool check_cache(std::string username, std::string password);
+    // these two save no account fields, so the account is looked up again when it is checked
     bool save_in_cache(std::string username, std::string password);
 
     bool save_in_cache_w_salt(std::string username, std::string password, std::string salt);
+    // saves the hash, salt and account fields, the record's timestamp is ignored and set to now
+    bool save_record(std::string username, const CacheRecord& record);
     bool get_user_from_cache(std::string username, std::string& salt);
+
+    // fetches the whole record for a user in one query
+    // expired records are returned while they are inside the stale_if_error window, so check the timestamp
+    bool lookup(std::string username, CacheRecord& record);
+    bool remove_user(std::string username);
+    // replaces the hash and salt of a user who is already cached, and forgets any negative entries for them
+    bool update_user(std::string username, const CacheRecord& record);
+    // drops every cached user and negative entry for the realm from sqlite and shared memory, other processes'
+    // process caches are not reached
+    bool clear();
+    // true if any cache database for the realm has been created
+    bool exists();
+
+    // saves (username, record) pairs in one transaction per shard, record timestamps are ignored and set to now
+    bool save_many(const std::vector<std::pair<std::string, CacheRecord>>& records);
+
+    // negative cache, these do nothing (and find nothing) unless the matching ttl option is set
+    // attempt is a hash identifying the rejected username/password pair
+    bool is_unknown_user(std::string username);
+    bool save_unknown_user(std::string username);
+    bool is_failed_attempt(std::string username, std::string attempt);
+    bool save_failed_attempt(std::string username, std::string attempt);
 };
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// a cached credential, password is the stored hash (of salt + password when salted)
+// the account fields come from the same item and are what pam_sm_acct_mgmt checks
+struct CacheRecord {
+  std::string password;
+  std::string salt;
+  bool salted;
+  int timestamp;
+  // false for a row cached before the account fields were kept, the account has to be looked up again
+  bool account_known = true;
+  // the item's enabled attribute, an item without one is enabled
+  bool enabled = true;
+  // unix time the account expires from the item's expires_at, 0 for never
+  int64_t expires_at = 0;
+  // the item's groups, comma separated
+  std::string groups;
+};
\ No newline at end of file
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Options.h"
+
+// the settings of one module call which would otherwise be process wide (the log level and whether stats are
+// kept), applied to the calling thread only for the life of the object, so threads serving logins with different
+// pam.d settings at the same time do not change each other's
+// threads a call starts (background refreshes, hedged reads, the write-behind thread) use the process wide values
+// unless they make their own context
+class CallContext {
+  public:
+    explicit CallContext(const Options& opts);
+    ~CallContext();
+
+  private:
+    int saved_log_level;
+    int saved_stats;
+};
\ No newline at end of file
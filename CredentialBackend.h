@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "CacheRecord.h"
+#include "Options.h"
+
+// results of a backend lookup
+enum FetchResult {
+  FETCH_FOUND,
+  FETCH_NOT_FOUND,
+  FETCH_ERROR
+};
+
+// where the password hash and salt for a (realm, username) pair come from when the caches cannot answer
+// implementations must be safe to call from several threads at once
+class CredentialBackend {
+  public:
+    virtual ~CredentialBackend() {}
+
+    // fills record (timestamped now) and returns one of FetchResult
+    virtual int fetch(const std::string& realm, const std::string& username, CacheRecord& record) = 0;
+};
+
+// users held in memory, for tools and benchmarks which need a backend without a table
+class MemoryBackend : public CredentialBackend {
+  public:
+    void add(const std::string& realm, const std::string& username, const CacheRecord& record);
+    int fetch(const std::string& realm, const std::string& username, CacheRecord& record);
+
+  private:
+    std::mutex mutex;
+    std::map<std::string, CacheRecord> users;
+};
+
+// returns the backend the module settings ask for, DynamoDB (hedged across regions if several are given) unless
+// a snapshot file is given, in which case users missing from the snapshot (or all users if it cannot be read) are
+// looked up in DynamoDB
+std::shared_ptr<CredentialBackend> make_backend(const std::string& region, const std::string& table, const Options& opts);
\ No newline at end of file
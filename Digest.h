@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+// SHA3-256 as lower case hex, plus the terminating nul
+const int kDigestHexSize = 65;
+
+// SHA3-256 as raw bytes, as the sqlite cache stores it
+const int kDigestSize = 32;
+
+// a hex digest held on the stack
+struct HexDigest {
+  char hex[kDigestHexSize];
+
+  HexDigest() { hex[0] = '\0'; }
+  bool empty() const { return hex[0] == '\0'; }
+  std::string str() const { return std::string(hex, kDigestHexSize - 1); }
+};
+
+// hashes prefix followed by password (e.g. salt and password) without joining them first
+// each thread keeps its own digest context, so this does not allocate
+bool hash_password(const std::string& prefix, const std::string& password, HexDigest& hashed);
+
+// packs a lower case hex digest into kDigestSize bytes, returns false if hex is not one (e.g. a hash in another format)
+bool digest_to_bytes(const std::string& hex, unsigned char *bytes);
+// the lower case hex for kDigestSize bytes
+std::string digest_to_hex(const unsigned char *bytes);
+
+// compares a stored hex digest with a computed one in constant time
+bool digest_matches(const std::string& stored, const HexDigest& computed);
\ No newline at end of file
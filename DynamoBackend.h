@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <aws/dynamodb/DynamoDBClient.h>
+
+#include "CredentialBackend.h"
+
+// looks users up with GetItem on a table keyed on realm (hash) and user (sort)
+class DynamoBackend : public CredentialBackend {
+  public:
+    DynamoBackend(std::string region, std::string table, int timeout_ms = 0, std::string endpoint = "");
+    int fetch(const std::string& realm, const std::string& username, CacheRecord& record);
+
+  private:
+    std::string region;
+    std::string table;
+    int timeout_ms;
+    std::string endpoint;
+};
+
+// reads every user in a realm with Query, paging through the results, returns false if a page fails
+bool query_realm(Aws::DynamoDB::DynamoDBClient& client, const std::string& table, const std::string& realm,
+                 std::vector<std::pair<std::string, CacheRecord>>& records);
\ No newline at end of file
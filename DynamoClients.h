@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+
+#include <aws/dynamodb/DynamoDBClient.h>
+#include <aws/dynamodb/model/AttributeValue.h>
+
+#include "CacheRecord.h"
+
+// returns a DynamoDB client for the region, creating it on first use
+// timeout_ms sets the connect and request timeouts, 0 leaves the SDK defaults
+// endpoint replaces the AWS endpoint for the region (e.g. http://localhost:8000 for DynamoDB Local) if not empty
+// the AWS SDK is initialised on the first call and shut down when the process exits, a forked child initialises it
+// again on its first call rather than using the threads and clients of its parent
+std::shared_ptr<Aws::DynamoDB::DynamoDBClient> get_dynamo_client(const std::string& region, int timeout_ms = 0, const std::string& endpoint = "");
+
+
+// asks for the attributes item_to_record reads as well as the given key attributes (e.g. "#user"), the names which
+// are DynamoDB reserved words go through #name placeholders
+template<class Request>
+void project_user_attributes(Request& req, const std::string& keys) {
+  req.AddExpressionAttributeNames("#user", "user");
+  req.AddExpressionAttributeNames("#enabled", "enabled");
+  req.AddExpressionAttributeNames("#expires_at", "expires_at");
+  req.AddExpressionAttributeNames("#groups", "groups");
+  req.SetProjectionExpression(Aws::String((keys + ", password, salt, #enabled, #expires_at, #groups").c_str()));
+}
+
+// the value of a string or number attribute, e.g. "1", or an empty string for one of another type such as a BOOL
+template<class Value>
+std::string attribute_text(const Value& value) {
+  Aws::String text = value.GetN().empty() ? value.GetS() : value.GetN();
+  return std::string(text.c_str(), text.size());
+}
+
+// the DynamoDB and Streams attribute values name their BOOL getter differently, call with 0
+template<class Value>
+auto attribute_bool(const Value& value, int) -> decltype(value.GetBool()) {
+  return value.GetBool();
+}
+
+template<class Value>
+auto attribute_bool(const Value& value, long) -> decltype(value.GetBOOL()) {
+  return value.GetBOOL();
+}
+
+// fills record with the password hash, salt and account fields from a user item, returns false if the item has
+// no password
+// this is a template so it works for items from both the DynamoDB and DynamoDB Streams APIs
+template<class Item>
+bool item_to_record(const Item& item, CacheRecord& record) {
+  auto password = item.find("password");
+  if(password == item.end()) {
+    return false;
+  }
+  Aws::String saved_password = password->second.GetS();
+  record.password = std::string(saved_password.c_str(), saved_password.size());
+  auto salt = item.find("salt");
+  record.salted = salt != item.end();
+  if(record.salted) {
+    Aws::String saved_salt = salt->second.GetS();
+    record.salt = std::string(saved_salt.c_str(), saved_salt.size());
+  } else {
+    record.salt.clear();
+  }
+  // enabled is a BOOL, though a number or a string ("0", "false") is accepted too
+  auto enabled = item.find("enabled");
+  record.enabled = true;
+  if(enabled != item.end()) {
+    std::string text = attribute_text(enabled->second);
+    record.enabled = text.empty() ? attribute_bool(enabled->second, 0) : text != "0" && text != "false";
+  }
+  auto expires_at = item.find("expires_at");
+  record.expires_at = expires_at != item.end() ? strtoll(attribute_text(expires_at->second).c_str(), NULL, 10) : 0;
+  // groups is a string set, or a comma separated string
+  auto groups = item.find("groups");
+  record.groups.clear();
+  if(groups != item.end()) {
+    for(const auto& group : groups->second.GetSS()) {
+      record.groups += (record.groups.empty() ? "" : ",") + std::string(group.c_str(), group.size());
+    }
+    if(record.groups.empty()) {
+      record.groups = attribute_text(groups->second);
+    }
+  }
+  record.account_known = true;
+  record.timestamp = (int)time(NULL);
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CredentialBackend.h"
+
+// reads from whichever of several equivalent backends (e.g. the regions of a DynamoDB global table) is quickest
+// each read goes to the backend with the lowest recent latency, and if it has not answered after the hedge
+// percentile of its recent latencies the next quickest is asked as well, the first answer wins
+// latency estimates are kept per name for the life of the process, so they carry over between instances
+class HedgedBackend : public CredentialBackend {
+  public:
+    // names identify the backends in the estimates and logs, e.g. their regions
+    HedgedBackend(std::vector<std::string> names, std::vector<std::shared_ptr<CredentialBackend>> backends, int hedge_percentile, int hedge_delay_ms);
+    int fetch(const std::string& realm, const std::string& username, CacheRecord& record);
+
+  private:
+    std::vector<std::string> names;
+    std::vector<std::shared_ptr<CredentialBackend>> backends;
+    int hedge_percentile;
+    int hedge_delay_ms;
+};
\ No newline at end of file
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// FNV-1a over realm and username, with a separator so ("ab", "c") and ("a", "bc") differ
+// this is for spreading keys over slots and files, not for anything security related
+inline uint64_t key_hash(const std::string& realm, const std::string& username) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(char c : realm) {
+    hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+  }
+  hash = (hash ^ 0xff) * 1099511628211ULL;
+  for(char c : username) {
+    hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+  }
+  return hash;
+}
\ No newline at end of file
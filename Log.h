@@ -1,5 +1,7 @@
-// based on this https://stackoverflow.com/questions/2638654/redirect-c-stdclog-to-syslog-on-unix
+#pragma once
 
+#include <atomic>
+#include <ostream>
 #include <streambuf>
 #include <syslog.h>
 
@@ -14,20 +16,53 @@ enum LogPriority {
     kLogDebug   = LOG_DEBUG    // debug-level message
 };
 
-std::ostream& operator<< (std::ostream& os, const LogPriority& log_priority);
+// longest message we will format, anything after this is cut off
+const int kLogLineMax = 512;
 
-class Log : public std::basic_streambuf<char, std::char_traits<char> > {
+// opens syslog once for the process, later calls do nothing
+// option is passed to openlog, e.g. LOG_PID | LOG_PERROR for the command line tools
+void log_init(const char *ident, int facility, int option = LOG_PID);
+
+// messages less important than level are dropped before they are formatted
+void log_set_level(int level);
+
+// hands any buffered messages to syslog
+void log_flush();
+
+extern std::atomic<int> log_level;
+
+// the level for the calling thread while it runs a module call (see CallContext), -1 uses log_level
+extern thread_local int log_call_level;
+
+inline bool log_enabled(int priority) {
+    int level = log_call_level;
+    return priority <= (level >= 0 ? level : log_level.load(std::memory_order_relaxed));
+}
+
+// the text for an errno value, as strerror is not thread safe
+// use as LOG(kLogErr) << "Could not open file: " << ErrnoString(errno);
+struct ErrnoString {
+    char text[128];
+
+    explicit ErrnoString(int err);
+};
+
+std::ostream& operator<<(std::ostream& out, const ErrnoString& error);
+
+// one message, formatted into a fixed buffer on the stack and queued for syslog when it goes out of scope
+class LogLine : private std::streambuf {
 public:
-    explicit Log(std::string ident, int facility);
+    explicit LogLine(int priority);
+    ~LogLine();
 
-protected:
-    int sync();
-    int overflow(int c);
+    std::ostream& stream() { return stream_; }
 
 private:
-    friend std::ostream& operator<< (std::ostream& os, const LogPriority& log_priority);
-    std::string buffer_;
-    int facility_;
     int priority_;
-    char ident_[50];
-};
\ No newline at end of file
+    char buffer_[kLogLineMax];
+    std::ostream stream_;
+};
+
+// use as LOG(kLogInfo) << "message " << value;
+// nothing after LOG(...) is evaluated if the priority is not enabled
+#define LOG(priority) if(!log_enabled(priority)) {} else LogLine(priority).stream()
\ No newline at end of file
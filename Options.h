@@ -0,0 +1,86 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// optional module settings
+// these are given in the pam.d file as name=value arguments after the five positional arguments
+struct Options {
+  // the REGION and TABLE arguments, set by whoever reads the positional arguments rather than by name=value
+  // together with the cache folder they keep the shared caches of different tables apart (see cache_scope)
+  std::string region;
+  std::string table;
+  // number of entries in the shared memory cache which sits in front of sqlite, 0 turns it off
+  int shm_cache_slots;
+  // kilobytes of credentials each process keeps for itself in front of the shared memory cache, 0 turns it off
+  int process_cache_kb;
+  // seconds an entry in the process cache is used before it is read again from the shared caches, 0 for no limit
+  int process_cache_ttl;
+  // seconds to remember users the backend does not know about, 0 turns it off
+  int negative_user_ttl;
+  // seconds to remember rejected username/password pairs, 0 turns it off
+  int negative_password_ttl;
+  // milliseconds a cache miss will wait for a lookup of the same user already in progress, 0 turns it off
+  int coalesce_wait_ms;
+  // seconds after which a cache hit also refreshes the entry from the backend in the background, 0 turns it off
+  int cache_soft_ttl;
+  // seconds past expiry that a cache entry can still be used if the backend fails or times out, 0 turns it off
+  int stale_if_error;
+  // connect and request timeout for backend calls in milliseconds, 0 uses the SDK defaults
+  int backend_timeout_ms;
+  // DynamoDB regions to read from (e.g. the replicas of a global table), empty uses the REGION argument
+  std::vector<std::string> regions;
+  // endpoint to use instead of AWS for a region, e.g. DynamoDB Local, given as endpoint_<region>=URL
+  std::map<std::string, std::string> endpoints;
+  // with several regions, a second region is asked once the first has taken longer than this percentile of
+  // its recent reads, 0 turns hedging off so other regions are only tried after an error
+  int hedge_percentile;
+  // least milliseconds to wait before hedging, also used until a region has enough reads to estimate from
+  int hedge_delay_ms;
+  // snapshot file written by pam-dynamo-snapshot to look users up in before DynamoDB, empty turns it off
+  std::string snapshot_path;
+  // number of sqlite files each realm's cache is spread over by username, so writers contend on separate locks
+  // the tools must be given the same value as the module
+  int cache_shards;
+  // 1 to put the sqlite cache in WAL mode, 0 keeps the rollback journal (e.g. for a cache folder on a network filesystem)
+  int cache_wal;
+  // megabytes of the sqlite cache file to read through mmap, 0 turns it off
+  int cache_mmap_mb;
+  // milliseconds to wait for another process writing to the sqlite cache before giving up
+  int cache_busy_timeout_ms;
+  // most users to keep in each sqlite cache, the least recently saved are evicted by the sweep, 0 is unlimited
+  int cache_max_rows;
+  // seconds between sweeps which delete expired rows and apply cache_max_rows, 0 turns sweeping off
+  int cache_sweep_interval;
+  // 1 to write successful logins to the sqlite cache from a background thread in batches, 0 writes them before returning
+  int cache_write_behind;
+  // most saves waiting for the background thread, further saves are written directly until it catches up
+  int cache_write_queue;
+  // backend calls allowed per user per minute across the host, further cache misses are rejected, 0 turns it off
+  int user_calls_per_min;
+  // backend calls allowed per realm per second across the host, further cache misses are rejected, 0 turns it off
+  int realm_calls_per_sec;
+  // most backend calls in progress at once across the host, further cache misses are rejected, 0 turns it off
+  int max_inflight_calls;
+  // 1 to have pam_sm_acct_mgmt check the enabled, expires_at and groups attributes, 0 allows every account
+  int account_checks;
+  // groups allowed by pam_sm_acct_mgmt, a user has to be in one of them, empty does not check groups
+  std::vector<std::string> allowed_groups;
+  // socket of a pam-dynamo-authd to authenticate through, empty (or the daemon not answering) authenticates in process
+  std::string authd_socket;
+  // milliseconds to wait for pam-dynamo-authd to answer before authenticating in process
+  int authd_timeout_ms;
+  // 1 to count outcomes and stage latencies in the shared stats segment, 0 turns it off
+  int stats;
+  // least important syslog priority to log, e.g. LOG_INFO
+  int log_level;
+
+  Options();
+
+  // the endpoint_<region> setting for region, or an empty string for the AWS endpoint
+  std::string endpoint_for(const std::string& region) const;
+};
+
+// reads the name=value arguments from argv[first] onwards, unknown or invalid values are logged and skipped
+void parse_options(int argc, const char **argv, int first, Options& opts);
\ No newline at end of file
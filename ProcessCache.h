@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "CacheRecord.h"
+
+// credential cache private to this process, for hosts which keep the module loaded (e.g. Apache with
+// mod_authnz_pam or pam-dynamo-authd) so a repeat login does not touch shared memory or sqlite at all
+// it is a bounded LRU map keyed on (scope, realm, username), split into shards which each have their own lock
+// the process only sees its own writes, so entries are dropped after ttl seconds to pick up changes made elsewhere
+// (pam-dynamo-streamd and other processes cannot reach it)
+class ProcessCache {
+  public:
+    // kb is the memory budget and is only used by the first cache in the process to need it, 0 turns it off
+    // ttl is the most seconds an entry is trusted, 0 trusts it until the credential itself expires
+    // scope is the owning cache's folder, table and region (see cache_scope)
+    ProcessCache(int kb, int ttl, const std::string& scope);
+
+    // counts a hit or a miss in the stats
+    bool get(const std::string& realm, const std::string& username, CacheRecord& record);
+    void put(const std::string& realm, const std::string& username, const CacheRecord& record);
+    void remove(const std::string& realm, const std::string& username);
+
+  private:
+    int kb;
+    int ttl;
+    std::string scope;
+};
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include "Options.h"
+
+// limits on backend calls shared by every process on the host, so a burst of bad logins cannot use up the table's
+// read capacity for everyone, the token buckets live in /dev/shm/pam-dynamo-limits and the in-flight cap is a SysV
+// semaphore (SEM_UNDO gives back the slots of a process which dies mid call), one of each per user and, for the
+// semaphore, per cap (see SegmentOwner.h)
+// if either cannot be set up, or belongs to another user, the limit is not applied
+
+enum LimitResult {
+  LIMIT_OK,
+  LIMIT_USER,      // the user has made too many backend calls recently
+  LIMIT_REALM,     // the realm has made too many backend calls recently
+  LIMIT_INFLIGHT   // every in-flight slot is taken
+};
+
+// takes a token from the user's bucket and then the realm's, returns one of LimitResult
+int take_backend_tokens(const std::string& realm, const std::string& username, const Options& opts);
+
+// holds one of the max_inflight_calls slots for its lifetime
+class BackendSlot {
+  public:
+    // processes with the same max_inflight share a semaphore of that many slots, 0 turns the cap off
+    explicit BackendSlot(int max_inflight);
+    ~BackendSlot();
+
+    // false if every slot was taken
+    bool acquired() const;
+
+  private:
+    // -1 when there is no cap
+    int semid;
+    bool held;
+};
\ No newline at end of file
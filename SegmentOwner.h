@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+
+// shared memory segments and semaphores have names any local user could create first, so one is only used when it
+// belongs to this user or root and nobody else can open it, otherwise another user could plant entries in it
+inline bool trusted_owner(uid_t owner, mode_t mode) {
+  return (owner == geteuid() || owner == 0) && (mode & 077) == 0;
+}
+
+// the name of a shared object for this user, root keeps base and every other user gets base-<uid>, so services
+// running as different users each have their own rather than one refusing the other's
+inline std::string user_object_name(const std::string& base) {
+  uid_t uid = geteuid();
+  return uid == 0 ? base : base + "-" + std::to_string(uid);
+}
\ No newline at end of file
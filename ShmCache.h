@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "CacheRecord.h"
+
+// cross-process credential cache kept in a memory mapped segment under /dev/shm
+// it is a fixed size open addressing table keyed on (scope, realm, username), readers take no locks and instead
+// retry if the entry's sequence number shows it was being written while they copied it (a seqlock)
+// all calls quietly do nothing if the segment cannot be opened, the sqlite cache remains the source of truth
+class ShmCache {
+  public:
+    // slots is only used by the first process to create the segment, later ones use whatever size it has
+    // scope is the Cache's cache_scope, entries are only found by a ShmCache with the same one
+    ShmCache(int slots, const std::string& scope);
+
+    bool get(const std::string& realm, const std::string& username, CacheRecord& record);
+    // false if the record was not stored (e.g. another writer had the slot), an older entry may then remain so
+    // callers writing a new hash should remove the key
+    bool put(const std::string& realm, const std::string& username, const CacheRecord& record);
+    // marks the entry as expired, waiting for other writers rather than skipping it
+    void remove(const std::string& realm, const std::string& username);
+    // marks every entry of the realm as expired, this walks the whole segment
+    void remove_realm(const std::string& realm);
+
+  private:
+    int slots;
+    uint64_t scope;
+};
+
+// the segment's name, for programs (e.g. pam-dynamo-bench) which must not touch the host's cache, call it before
+// the first cache is used, processes not running as root add -<uid> to it (see user_object_name)
+void shm_cache_set_name(const std::string& name);
\ No newline at end of file
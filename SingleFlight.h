@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+struct Flight;
+
+// collapses concurrent cache misses for the same (realm, username) into one backend lookup
+// inside a process callers queue behind the first caller's flight, across processes they queue on a byte of the
+// cache folder's flight.lock file chosen by hashing the user, either way they wait at most wait_ms and then go
+// ahead on their own
+class SingleFlight {
+  public:
+    SingleFlight(std::string directory, std::string realm, std::string username, int wait_ms);
+    ~SingleFlight();
+
+    // returns true if another caller was already looking this user up and we waited for it,
+    // in which case the cache should be checked again before calling the backend
+    bool join();
+
+  private:
+    std::string key;
+    std::string lock_path;
+    int lock_slot;
+    int wait_ms;
+    std::shared_ptr<Flight> flight;
+    bool leader;
+    int lock_fd;
+};
\ No newline at end of file
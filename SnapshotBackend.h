@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CredentialBackend.h"
+
+// one user to write into a snapshot
+struct SnapshotRecord {
+  std::string realm;
+  std::string username;
+  CacheRecord record;
+};
+
+// answers lookups from a read-only snapshot file, a sorted array of fixed width records which is memory mapped
+// once per process and binary searched, so a lookup costs a few page reads and no system calls beyond a stat
+// the file is remapped when it is replaced, users it does not have are passed on to the fallback (if any)
+class SnapshotBackend : public CredentialBackend {
+  public:
+    SnapshotBackend(std::string path, std::shared_ptr<CredentialBackend> fallback = nullptr);
+    int fetch(const std::string& realm, const std::string& username, CacheRecord& record);
+
+  private:
+    std::string path;
+    std::shared_ptr<CredentialBackend> fallback;
+};
+
+// sorts the records and writes them to path, replacing any existing snapshot atomically
+// records whose fields do not fit the fixed width layout are left out and counted in skipped
+bool write_snapshot(const std::string& path, const std::vector<SnapshotRecord>& records, size_t& skipped);
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+// outcomes counted across every process on the host
+enum StatCounter {
+  STAT_CACHE_HIT,          // password matched a current cache entry
+  STAT_CACHE_MISS,         // the backend had to be asked
+  STAT_PROCESS_HIT,        // found in this process's own cache (process_cache_kb)
+  STAT_PROCESS_MISS,       // not in this process's own cache, so shared memory or sqlite was checked
+  STAT_CACHE_NEGATIVE,     // rejected from the negative caches
+  STAT_STALE_SERVED,       // expired entry accepted because the backend failed
+  STAT_COALESCED,          // waited for another lookup of the same user
+  STAT_BACKEND_FOUND,
+  STAT_BACKEND_NOT_FOUND,
+  STAT_BACKEND_ERROR,
+  STAT_BACKEND_HEDGED,     // a second region was asked because the first was slow
+  STAT_RATE_LIMITED,       // the backend was not asked because of a rate or in-flight limit
+  STAT_AUTH_SUCCESS,
+  STAT_AUTH_FAILURE,
+  STAT_COUNTER_COUNT
+};
+
+// stages whose latency is recorded, later stages can include earlier ones (a lookup may open the cache)
+enum StatStage {
+  STAGE_AUTHENTICATE,      // the whole of pam_sm_authenticate
+  STAGE_HASH,
+  STAGE_CACHE_OPEN,
+  STAGE_CACHE_LOOKUP,      // fetching the hash and salt from the process, shm or sqlite cache
+  STAGE_BACKEND,
+  STAGE_CACHE_WRITE,
+  STAGE_COUNT
+};
+
+// bucket i counts durations under 2^i microseconds, the last bucket takes everything longer
+const int kStatBuckets = 24;
+
+// a copy of the segment's values, as read by pam-dynamo-stats
+struct StatsSnapshot {
+  uint64_t counters[STAT_COUNTER_COUNT];
+  uint64_t buckets[STAGE_COUNT][kStatBuckets];
+  uint64_t sum_ns[STAGE_COUNT];
+};
+
+const char *stat_counter_name(int counter);
+const char *stat_stage_name(int stage);
+
+// the segment's name, for programs (e.g. pam-dynamo-bench) which must not touch the host's stats, call it before
+// anything is counted
+void stats_set_name(const std::string& name);
+
+// stats are only kept once enabled, the segment (/dev/shm/pam-dynamo-stats) is created on first use
+void stats_set_enabled(bool enabled);
+
+extern std::atomic<bool> stats_enabled;
+
+// whether the calling thread counts while it runs a module call (see CallContext), -1 uses stats_enabled
+extern thread_local int stats_call_enabled;
+
+inline bool stats_active() {
+  int enabled = stats_call_enabled;
+  return enabled >= 0 ? enabled != 0 : stats_enabled.load(std::memory_order_relaxed);
+}
+
+void stat_add(StatCounter counter);
+void stat_record(StatStage stage, uint64_t ns);
+
+// copies the current values, returns false if no process has created the segment
+bool stats_read(StatsSnapshot& snapshot);
+// zeroes every counter and histogram
+bool stats_reset();
+
+inline uint64_t stat_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// records the time from construction to destruction against a stage
+class StageTimer {
+  public:
+    explicit StageTimer(StatStage p_stage) : stage(p_stage), started(stats_active() ? stat_now_ns() : 0) {}
+    ~StageTimer() {
+      if(started != 0) {
+        stat_record(stage, stat_now_ns() - started);
+      }
+    }
+
+  private:
+    StatStage stage;
+    uint64_t started;
+};
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+// the users served by pam-dynamo-fakedb and logged in by pam-dynamo-loadgen, user<i> has password password<i>
+// and, when the fake table is salted, salt salt<i>
+
+inline std::string synthetic_username(long i) {
+  return "user" + std::to_string(i);
+}
+
+inline std::string synthetic_password(long i) {
+  return "password" + std::to_string(i);
+}
+
+inline std::string synthetic_salt(long i) {
+  return "salt" + std::to_string(i);
+}
+
+// the index of a synthetic username, or -1 if it is not one
+inline long synthetic_index(const std::string& username) {
+  if(username.compare(0, 4, "user") != 0 || username.length() == 4 || username.length() > 22) {
+    return -1;
+  }
+  long i = 0;
+  for(size_t pos = 4; pos < username.length(); pos++) {
+    if(username[pos] < '0' || username[pos] > '9' || (pos == 4 && username[pos] == '0' && username.length() > 5)) {
+      return -1;
+    }
+    i = i * 10 + (username[pos] - '0');
+  }
+  return i;
+}
\ No newline at end of file
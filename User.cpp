@@ -1,192 +1,396 @@
 #include <iostream>
-#include <iomanip>
-
-#include <aws/core/Aws.h>
-#include <aws/core/utils/Outcome.h> 
-#include <aws/dynamodb/DynamoDBClient.h>
-#include <aws/dynamodb/model/AttributeDefinition.h>
-#include <aws/dynamodb/model/GetItemRequest.h>
-#include <openssl/evp.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
 
 #include "User.h"
 #include "Log.h"
 #include "Cache.h"
+#include "CallContext.h"
+#include "Digest.h"
+#include "RateLimit.h"
+#include "SingleFlight.h"
+#include "Stats.h"
+
+User::User(std::string p_region, std::string p_ddbtable, std::string p_realm, std::string p_dir, int dur, std::string p_username, Options p_opts)
+  : User(make_backend(p_region, p_ddbtable, p_opts), p_realm, p_dir, dur, p_username, p_opts) {
+  opts.region = p_region;
+  opts.table = p_ddbtable;
+}
 
-User::User(std::string p_region, std::string p_ddbtable, std::string p_realm, std::string p_dir, int dur, std::string p_username) {
-  region = p_region;
-  ddbtable = p_ddbtable;
+User::User(std::shared_ptr<CredentialBackend> p_backend, std::string p_realm, std::string p_dir, int dur, std::string p_username, Options p_opts) {
+  backend = p_backend;
   realm = p_realm;
   username = p_username;
   cache_location = p_dir;
   session_dur = dur;
+  opts = p_opts;
 }
 
-// based on this code https://stackoverflow.com/questions/2262386/generate-sha256-with-openssl-and-c
-// and this code https://wiki.openssl.org/index.php/EVP_Message_Digests
-bool hash_password(const std::string& unhashed, std::string& hashed) {
-	EVP_MD_CTX *mdctx;
-  bool success = false;
-
-  mdctx = EVP_MD_CTX_new();
-	if(mdctx != NULL) {
-    if(EVP_DigestInit_ex(mdctx, EVP_sha3_256(), NULL)) {
-      if(EVP_DigestUpdate(mdctx, unhashed.c_str(), unhashed.length())) {
-        unsigned char hash[EVP_MAX_MD_SIZE];
-        unsigned int lengthOfHash = 0;
-
-        if(EVP_DigestFinal_ex(mdctx, hash, &lengthOfHash)) {
-          std::stringstream ss;
-          for(unsigned int i = 0; i < lengthOfHash; ++i) {
-            ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-          }
-
-          hashed = ss.str();
-          success = true;
-        }
-      } else {
-        // could not add message to digest
-        std::clog << kLogErr << "Unable to add password to digest" << std::endl;
+// answers from the local caches, CACHE_MISS means the backend needs to be asked
+// CACHE_STALE means the password matched an expired record which may still be used if the backend fails
+enum CacheAnswer {
+  CACHE_MISS,
+  CACHE_ACCEPT,
+  CACHE_REJECT,
+  CACHE_STALE
+};
+
+int User::check_caches(Cache& c, const std::string& password, CacheRecord& cached, HexDigest& hashed_pword, std::string& attempt) {
+  // fetch the cached record (hash, salt and timestamp) in one go
+  LOG(kLogDebug) << "Checking cache for username";
+  bool found = false;
+  {
+    StageTimer timer(STAGE_CACHE_LOOKUP);
+    found = c.lookup(username, cached);
+  }
+  if(found) {
+    // there's a record in the cache, so hash once using its salt and compare
+    LOG(kLogDebug) << "Got record from cache, salted=" << cached.salted;
+    bool hashed = false;
+    {
+      StageTimer timer(STAGE_HASH);
+      hashed = hash_password(cached.salt, password, hashed_pword);
+    }
+    if(!hashed) {
+      LOG(kLogErr) << "Hashing password failed";
+      return CACHE_REJECT;
+    }
+    LOG(kLogDebug) << "Hashed input password = " << hashed_pword.hex;
+    if(digest_matches(cached.password, hashed_pword)) {
+      int age = (int)time(NULL) - cached.timestamp;
+      if(age >= session_dur) {
+        // only kept around in case the backend is unavailable
+        LOG(kLogInfo) << "User found in cache but entry has expired";
+        return CACHE_STALE;
       }
-    } else {
-      // could not init digest algorithm
-      std::clog << kLogErr << "Unable to init digest algorithm" << std::endl;
+      if(opts.cache_soft_ttl > 0 && age >= opts.cache_soft_ttl) {
+        // still good, but refresh it so it does not expire under a busy user
+        LOG(kLogInfo) << "User found in cache after soft ttl, refreshing in background";
+        refresh_in_background(cached);
+      }
+      // user is in the cache
+      LOG(kLogInfo) << "User found in cache, skipping AWS call";
+      stat_add(STAT_CACHE_HIT);
+      return CACHE_ACCEPT;
     }
-    EVP_MD_CTX_free(mdctx);
+  }
+
+  // check the negative cache before going to AWS
+  if(c.is_unknown_user(username)) {
+    LOG(kLogInfo) << "User recently not found in realm, skipping AWS call";
+    stat_add(STAT_CACHE_NEGATIVE);
+    return CACHE_REJECT;
+  }
+  // rejected attempts are keyed on a hash of the username and password so the password is not stored
+  HexDigest attempt_digest;
+  if(opts.negative_password_ttl > 0 && attempt.empty() && hash_password(username + '\n', password, attempt_digest)) {
+    attempt = attempt_digest.str();
+  }
+  if(!attempt.empty()) {
+    if(c.is_failed_attempt(username, attempt)) {
+      LOG(kLogInfo) << "Password recently rejected for user, skipping AWS call";
+      stat_add(STAT_CACHE_NEGATIVE);
+      return CACHE_REJECT;
+    }
+  }
+  return CACHE_MISS;
+}
+
+// most refreshes waiting for the refresh thread, further soft ttl hits are not refreshed until it catches up
+const size_t kMaxQueuedRefreshes = 256;
+
+// milliseconds an exiting process waits for a refresh in the middle of a backend call
+const int kRefreshExitWaitMs = 5;
+
+// background refreshes for this process, run one at a time on a single thread started on first use (and again
+// after a fork), keys holds the realm and username of every queued or running refresh so each is only done once
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+struct RefreshQueue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::pair<std::string, std::function<void()>>> waiting;
+  std::set<std::string> keys;
+  bool running = false;
+  bool stopping = false;
+  std::thread *worker = NULL;
+  pid_t pid = 0;
+};
+
+static RefreshQueue& refresh_queue = *new RefreshQueue();
+
+void run_refreshes() {
+  RefreshQueue& q = refresh_queue;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  while(true) {
+    q.cv.wait(lock, [&q] { return q.stopping || !q.waiting.empty(); });
+    if(q.stopping) {
+      return;
+    }
+    std::pair<std::string, std::function<void()>> refresh = q.waiting.front();
+    q.waiting.pop_front();
+    q.running = true;
+    lock.unlock();
+    refresh.second();
+    lock.lock();
+    q.keys.erase(refresh.first);
+    q.running = false;
+    q.cv.notify_all();
+  }
+}
+
+void User::refresh(const CacheRecord& cached) {
+  CallContext context(opts);
+  CacheRecord fetched = CacheRecord();
+  int limited = LIMIT_OK;
+  int result = fetch_from_backend(fetched, limited);
+  if(limited != LIMIT_OK) {
+    // the entry is still good, a later hit will try again
+    return;
+  }
+  Cache c(realm, cache_location, session_dur, opts);
+  if(result == FETCH_FOUND && fetched.password == cached.password && fetched.salt == cached.salt) {
+    // the password has not changed, so the entry is good for another session duration, with the account fields
+    // as they are now
+    bool saved = c.save_record(username, fetched);
+    LOG(kLogInfo) << "Background refresh of cache entry done, saved=" << saved;
+  } else if(result != FETCH_ERROR) {
+    // the password has changed or the user has gone, the next login has to go to the backend
+    LOG(kLogInfo) << "Backend record changed, removing cache entry";
+    c.remove_user(username);
+  }
+}
+
+void User::refresh_in_background(const CacheRecord& cached) {
+  std::string key = realm + '\n' + username;
+  RefreshQueue& q = refresh_queue;
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if(q.pid != getpid()) {
+    // forked, the parent's thread does not exist here and the parent will do what it had queued
+    q.waiting.clear();
+    q.keys.clear();
+    q.running = false;
+    q.worker = NULL;
+    q.pid = getpid();
+  }
+  if(q.stopping || q.waiting.size() >= kMaxQueuedRefreshes || !q.keys.insert(key).second) {
+    // exiting, too far behind or already queued
+    return;
+  }
+  // the refresh works on its own copy of this user
+  User copy(*this);
+  q.waiting.push_back(std::make_pair(key, std::function<void()>([copy, cached]() mutable { copy.refresh(cached); })));
+  if(q.worker == NULL) {
+    q.worker = new std::thread(run_refreshes);
+  }
+  q.cv.notify_all();
+}
+
+// runs when the process exits
+// queued refreshes are dropped, the entries stay valid until they expire, and one in the middle of a backend call is
+// only waited for briefly so short lived processes such as sshd children do not pay for it, after that it ends with
+// the process, the module is never unloaded so its code stays mapped until then
+__attribute__((destructor))
+static void stop_refreshes() {
+  RefreshQueue& q = refresh_queue;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  if(q.worker == NULL || q.pid != getpid()) {
+    return;
+  }
+  q.stopping = true;
+  q.waiting.clear();
+  q.cv.notify_all();
+  if(q.cv.wait_for(lock, std::chrono::milliseconds(kRefreshExitWaitMs), [&q] { return !q.running; })) {
+    lock.unlock();
+    q.worker->join();
   } else {
-    // could not get message digest context
-    std::clog << kLogErr << "Could not get message digest context" << std::endl;
+    q.worker->detach();
   }
-  return success;
-} 
+}
 
-bool User::authenticate(std::string password) {
-  bool ret_val = false;
+int User::check_password(std::string password) {
+  HexDigest hashed_pword;
+  std::string attempt;
+  Cache c(realm, cache_location, session_dur, opts);
+  CacheRecord cached = CacheRecord();
+
+  int answer = check_caches(c, password, cached, hashed_pword, attempt);
+  if(answer != CACHE_MISS && answer != CACHE_STALE) {
+    return(answer == CACHE_ACCEPT ? AUTH_ACCEPTED : AUTH_REJECTED);
+  }
+
+  // if someone else is already fetching this user wait for them and then look in the cache again
+  SingleFlight flight(cache_location, realm, username, opts.coalesce_wait_ms);
+  if(flight.join()) {
+    stat_add(STAT_COALESCED);
+    LOG(kLogDebug) << "Checking cache again after waiting for other lookup";
+    answer = check_caches(c, password, cached, hashed_pword, attempt);
+    if(answer != CACHE_MISS && answer != CACHE_STALE) {
+      return(answer == CACHE_ACCEPT ? AUTH_ACCEPTED : AUTH_REJECTED);
+    }
+  }
+
+  LOG(kLogInfo) << "User not in cache, calling backend...";
+  stat_add(STAT_CACHE_MISS);
+  CacheRecord fetched = CacheRecord();
+  int limited = LIMIT_OK;
+  int result = fetch_from_backend(fetched, limited);
 
-  // need to hash the password before we check the cache
-  std::string hashed_pword;
-  if(hash_password(password, hashed_pword)) {
-    std::clog << kLogDebug << "Hashed input password = " << hashed_pword << std::endl;
+  if(limited != LIMIT_OK) {
+    // treated like a failed call, so an expired entry can still be used
+    if(answer == CACHE_STALE) {
+      LOG(kLogWarning) << "Accepting expired cache entry for user=" << username;
+      stat_add(STAT_STALE_SERVED);
+      return(AUTH_ACCEPTED);
+    }
+    return(limited == LIMIT_USER ? AUTH_USER_LIMITED : AUTH_BACKEND_LIMITED);
+  }
+  if(result == FETCH_ERROR) {
+    stat_add(STAT_BACKEND_ERROR);
+    if(answer == CACHE_STALE) {
+      LOG(kLogWarning) << "Backend unavailable, accepting expired cache entry for user=" << username;
+      stat_add(STAT_STALE_SERVED);
+      return(AUTH_ACCEPTED);
+    }
+    return(AUTH_REJECTED);
+  }
+  if(result == FETCH_NOT_FOUND) {
+    stat_add(STAT_BACKEND_NOT_FOUND);
+    c.save_unknown_user(username);
+    return(AUTH_REJECTED);
+  }
+  stat_add(STAT_BACKEND_FOUND);
+
+  // we may already have the right hash if the cache had the same salt
+  if(hashed_pword.empty() || fetched.salted != cached.salted || fetched.salt != cached.salt) {
+    if(fetched.salted) {
+      LOG(kLogInfo) << "Got salt, so hashing password with salt";
+    }
+    StageTimer timer(STAGE_HASH);
+    if(!hash_password(fetched.salt, password, hashed_pword)) {
+      LOG(kLogErr) << "Hashing password failed";
+      return(AUTH_REJECTED);
+    }
+  }
+
+  // compare the password hashes
+  if(!digest_matches(fetched.password, hashed_pword)) {
+    LOG(kLogInfo) << "Password does not match what is stored";
+    if(!attempt.empty()) {
+      c.save_failed_attempt(username, attempt);
+    }
+    return(AUTH_REJECTED);
+  }
+
+  LOG(kLogInfo) << "Password matches what is stored";
+  StageTimer timer(STAGE_CACHE_WRITE);
+  // need to update the cache, the account fields go with the hash so pam_sm_acct_mgmt can use them
+  fetched.password = hashed_pword.str();
+  if(c.save_record(username, fetched)) {
+    LOG(kLogInfo) << "Saved in cache, salted=" << fetched.salted;
   } else {
-    // failed to hash password
-    std::clog << kLogErr << "Hashing password failed" << std::endl;
-    return(false);
-  }
-
-  // need to check for a valid cache record with salt
-  std::clog << kLogInfo << "Checking cache for valid salt value" << std::endl;
-  Cache c(realm, cache_location, session_dur);
-  std::string cache_salt;
-  if(c.get_user_from_cache(username, cache_salt)) {
-    // there's a record in the cache 
-    std::clog << kLogInfo << "Got salt from cache = " << cache_salt << std::endl;
-    // so we need to rehash the password along with the salt
-    hash_password(cache_salt + password, hashed_pword);
-    std::clog << kLogInfo << "Rehashed password = " << hashed_pword << std::endl;
-  }
-
-  // check the cache 
-  std::clog << kLogInfo << "Checking cache for username/password combination" << std::endl;
-  if(c.check_cache(username, hashed_pword)) {
-    // user is in the cache
-    // so exit here with true
-    std::clog << kLogInfo << "User found in cache, skipping AWS call" << std::endl;
-    return(true);
-  }
-
-  std::clog << kLogInfo << "User not in cache, calling AWS..." << std::endl;
-  // user not in cache, so keep running
-
-  Aws::SDKOptions options;
-  std::clog << kLogInfo << "Init for AWS API" << std::endl;
-  Aws::InitAPI(options);
-  {
-    // get strings ready
-    const Aws::String as_ddbtable(ddbtable.c_str());
-    const Aws::String as_realm(realm.c_str());
-    const Aws::String as_username(username.c_str());
-    const Aws::String as_region(region.c_str());
-
-    // get request ready
-    Aws::Client::ClientConfiguration clientConfig;
-    clientConfig.region = as_region;
-    Aws::DynamoDB::DynamoDBClient dynamoClient(clientConfig);
-    Aws::DynamoDB::Model::GetItemRequest req;
-    
-    // set table
-    req.SetTableName(as_ddbtable);
-    // add hash key (auth realm)
-    Aws::DynamoDB::Model::AttributeValue hashKey;
-    hashKey.SetS(as_realm);
-    req.AddKey("realm", hashKey);
-    // add sort key (username)
-    Aws::DynamoDB::Model::AttributeValue sortKey;
-    sortKey.SetS(as_username);
-    req.AddKey("user", sortKey);
-
-    // fire request to API
-    std::clog << kLogInfo << "Calling DynamoDB API in region=" << region << std::endl;
-    const Aws::DynamoDB::Model::GetItemOutcome& result = dynamoClient.GetItem(req);
-    std::clog << kLogInfo << "Back from call to API" << std::endl;
-    if(result.IsSuccess()) {
-      std::clog << kLogInfo << "Result is a success from API" << std::endl;
-      // got a response
-      const Aws::Map<Aws::String, Aws::DynamoDB::Model::AttributeValue>& item = result.GetResult().GetItem();
-      if (item.size() > 1) {
-        // got an item, check to see if password is present
-        if(item.count("password") > 0) {
-          // check if we have salt
-          std::string std_salt;
-          bool salted = false;
-          if(item.count("salt") > 0) {
-            std::clog << kLogInfo << "Got salt, so re-hashing password with salt" << std::endl;
-            Aws::String salt = item.find("salt")->second.GetS();
-            std_salt = std::string(salt.c_str(), salt.size());
-            hash_password(std_salt + password, hashed_pword);
-            salted = true;
-          }
-          // get password from record
-          Aws::String saved_password = item.find("password")->second.GetS();
-          std::string std_saved_password(saved_password.c_str(), saved_password.size());
-
-          std::clog << kLogDebug << "Password from record = " << std_saved_password << std::endl;
-          // compare the password hashes
-          if(std_saved_password.compare(hashed_pword) == 0) {
-            std::clog << kLogInfo << "Password matches what is stored" << std::endl;
-            // need to update the cache
-            // if salted we should store the salt
-            if(salted) {
-              if(c.save_in_cache_w_salt(username, hashed_pword, std_salt)) {
-                std::clog << kLogInfo << "Saved in cache with salt" << std::endl;
-              } else {
-                std::clog << kLogErr << "Unable to save in cache, check previous messages" << std::endl;
-              }
-              ret_val = true;
-            } else {
-              if(c.save_in_cache(username, hashed_pword)) {
-                std::clog << kLogInfo << "Saved in cache without salt" << std::endl;
-              } else {
-                std::clog << kLogErr << "Unable to save in cache, check previous messages" << std::endl;
-              }
-              ret_val = true;
-            }
-          } else {
-            std::clog << kLogInfo << "Password does not match what is stored" << std::endl;
-            ret_val = false;
-          }
-        } else {
-          std::clog << kLogInfo << "No item with password field found" << std::endl;
-        }
-      } else {
-        // got no items, user does not exist
-        std::clog << kLogInfo << "No user found in realm=" << realm << ", with username=" << username << std::endl;
-        ret_val = false;
+    LOG(kLogErr) << "Unable to save in cache, check previous messages";
+  }
+  return(AUTH_ACCEPTED);
+}
+
+// keeps a burst of misses from using up the table's capacity, returns one of FetchResult (FETCH_ERROR when a limit
+// stopped the call) and sets limited to one of LimitResult
+int User::fetch_from_backend(CacheRecord& fetched, int& limited) {
+  int result = FETCH_ERROR;
+  limited = take_backend_tokens(realm, username, opts);
+  if(limited == LIMIT_OK) {
+    BackendSlot slot(opts.max_inflight_calls);
+    if(slot.acquired()) {
+      StageTimer timer(STAGE_BACKEND);
+      result = backend->fetch(realm, username, fetched);
+    } else {
+      limited = LIMIT_INFLIGHT;
+    }
+  }
+  if(limited != LIMIT_OK) {
+    static const char *limit_names[] = { "none", "user", "realm", "in-flight" };
+    LOG(kLogWarning) << "Backend call limit reached, not looking up user=" << username << ", limit=" << limit_names[limited];
+    stat_add(STAT_RATE_LIMITED);
+  }
+  return result;
+}
+
+// true if the comma separated groups include one of allowed
+static bool in_any_group(const std::string& groups, const std::vector<std::string>& allowed) {
+  size_t start = 0;
+  while(start <= groups.length()) {
+    size_t end = groups.find(',', start);
+    if(end == std::string::npos) {
+      end = groups.length();
+    }
+    for(const std::string& group : allowed) {
+      if(groups.compare(start, end - start, group) == 0) {
+        return true;
       }
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+int User::check_account() {
+  Cache c(realm, cache_location, session_dur, opts);
+  CacheRecord record = CacheRecord();
+  bool found = false;
+  {
+    StageTimer timer(STAGE_CACHE_LOOKUP);
+    found = c.lookup(username, record) && record.account_known;
+  }
+  if(!found || (int)time(NULL) - record.timestamp >= session_dur) {
+    LOG(kLogInfo) << "No current account record in cache, calling backend...";
+    CacheRecord fetched = CacheRecord();
+    int limited = LIMIT_OK;
+    int result = fetch_from_backend(fetched, limited);
+    if(result == FETCH_FOUND) {
+      stat_add(STAT_BACKEND_FOUND);
+      // the stored hash is what a login would cache, so the next login or account check does not need the backend
+      c.save_record(username, fetched);
+      record = fetched;
+    } else if(result == FETCH_NOT_FOUND) {
+      stat_add(STAT_BACKEND_NOT_FOUND);
+      c.remove_user(username);
+      c.save_unknown_user(username);
+      return(ACCOUNT_UNKNOWN);
     } else {
-      std::clog << kLogErr << "Failed to query table=" << ddbtable << ", error message=" << result.GetError().GetMessage();
-      ret_val = false;
+      if(limited == LIMIT_OK) {
+        stat_add(STAT_BACKEND_ERROR);
+      }
+      if(!found) {
+        return(ACCOUNT_UNAVAILABLE);
+      }
+      // lookup only returns an expired record inside the stale_if_error window
+      LOG(kLogWarning) << "Backend unavailable, checking expired cache entry for user=" << username;
+      stat_add(STAT_STALE_SERVED);
     }
+  }
 
+  if(!record.enabled) {
+    LOG(kLogInfo) << "Account is disabled";
+    return(ACCOUNT_DISABLED);
   }
-  Aws::ShutdownAPI(options);
-  return ret_val;
+  if(record.expires_at > 0 && record.expires_at <= (int64_t)time(NULL)) {
+    LOG(kLogInfo) << "Account expired at " << record.expires_at;
+    return(ACCOUNT_EXPIRED);
+  }
+  if(!opts.allowed_groups.empty() && !in_any_group(record.groups, opts.allowed_groups)) {
+    LOG(kLogInfo) << "Account is not in any of the allowed groups, groups=" << record.groups;
+    return(ACCOUNT_NOT_IN_GROUP);
+  }
+  return(ACCOUNT_OK);
+}
+
+bool User::authenticate(std::string password) {
+  return check_password(password) == AUTH_ACCEPTED;
 }
\ No newline at end of file
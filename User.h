@@ -1,16 +1,61 @@
+#pragma once
+
 #include <iostream>
+#include <memory>
+
+#include "CredentialBackend.h"
+#include "Options.h"
+
+class Cache;
+struct HexDigest;
+
+// results of User::check_password
+enum AuthStatus {
+  AUTH_ACCEPTED,
+  AUTH_REJECTED,
+  // the backend was not asked because the user has made too many calls recently
+  AUTH_USER_LIMITED,
+  // the backend was not asked because of the realm's rate or the in-flight limit
+  AUTH_BACKEND_LIMITED
+};
+
+// results of User::check_account
+enum AccountStatus {
+  ACCOUNT_OK,
+  ACCOUNT_DISABLED,
+  ACCOUNT_EXPIRED,
+  // allowed_groups is set and the user is in none of them
+  ACCOUNT_NOT_IN_GROUP,
+  ACCOUNT_UNKNOWN,
+  // the account could not be looked up, e.g. the backend failed or a limit stopped the call
+  ACCOUNT_UNAVAILABLE
+};
 
 class User {
   private:
-    std::string region;
-    std::string ddbtable;
+    std::shared_ptr<CredentialBackend> backend;
     std::string realm;
     std::string cache_location;
     int session_dur;
     std::string username;
     std::string password;
+    Options opts;
+
+    int check_caches(Cache& c, const std::string& password, CacheRecord& cached, HexDigest& hashed_pword, std::string& attempt);
+    // queues refresh for the process's refresh thread
+    void refresh_in_background(const CacheRecord& cached);
+    // fetches the user again and extends or drops the cached entry
+    void refresh(const CacheRecord& cached);
+    int fetch_from_backend(CacheRecord& fetched, int& limited);
 
   public:
-    User(std::string region, std::string ddbtable, std::string realm, std::string cache_location, int session_dur, std::string username);
+    User(std::string region, std::string ddbtable, std::string realm, std::string cache_location, int session_dur, std::string username, Options opts = Options());
+    // looks the user up in the given backend rather than the one the options describe
+    User(std::shared_ptr<CredentialBackend> backend, std::string realm, std::string cache_location, int session_dur, std::string username, Options opts = Options());
+    // returns one of AuthStatus
+    int check_password(std::string password);
     bool authenticate(std::string password);
+    // checks the account fields of the cached record, only asking the backend if the user has no current record
+    // (e.g. they authenticated with another module), returns one of AccountStatus
+    int check_account();
 };
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+#include "CacheRecord.h"
+#include "Options.h"
+
+// write-behind for cache saves, used by Cache when cache_write_behind is set
+// saves are queued per (cache_scope, realm) and a background thread writes them in batches, a later save of the same
+// user replaces a queued one, the thread is started on first use and again after a fork
+
+// queues a save, returns false if the queue is full and the caller should write the record itself
+bool queue_cache_write(const std::string& directory, const std::string& realm, int session_duration, const Options& opts,
+                       const std::string& username, const CacheRecord& record);
+
+// finds a save which has been queued but may not be in sqlite yet, scope is the Cache's cache_scope
+bool find_queued_write(const std::string& scope, const std::string& realm, const std::string& username, CacheRecord& record);
+
+// drops a queued save, e.g. because the user has been removed from the cache
+void forget_queued_write(const std::string& scope, const std::string& realm, const std::string& username);
+
+// writes everything queued and stops the thread, called when the process exits
+void flush_cache_writes();
\ No newline at end of file
@@ -0,0 +1,293 @@
+// pam-dynamo-authd, authenticates on behalf of the module so DynamoDB clients, cache connections and the in
+// memory caches last between logins instead of being rebuilt by every process that loads the module
+//
+// usage: pam-dynamo-authd SOCKET [--threads N] [--allow-uid UID ...] [--cache-folder DIR ...] [name=value ...]
+//
+// the module is pointed at the socket with authd=SOCKET and sends its own arguments with each request, so one
+// daemon serves every pam.d file on the host, connections are only accepted from root, the user running the
+// daemon and any --allow-uid users, the name=value settings are the daemon's own (e.g. log_level)
+// where credentials come from and which files are written is not up to the clients: requests are only served for
+// the --cache-folder folders (any folder for root when none are given) and with the daemon's own endpoint_<region>
+// and snapshot settings, other requests are sent back to authenticate in process
+
+#include <iostream>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Authd.h"
+#include "CredentialBackend.h"
+#include "Log.h"
+#include "Options.h"
+#include "Stats.h"
+#include "User.h"
+
+// how long a connected client has to send its request
+const int kRequestTimeoutMs = 5000;
+// most accepted connections waiting for a worker, further ones are closed straight away so clients cannot run the
+// daemon out of file descriptors, their modules authenticate in process
+const size_t kMaxQueuedConnections = 256;
+
+static volatile sig_atomic_t running = 1;
+
+void stop(int) {
+  running = 0;
+}
+
+// accepted connections waiting for a worker
+static std::mutex queue_mutex;
+static std::condition_variable queue_cv;
+static std::deque<int> queue;
+
+// backends are kept per REGION, TABLE and settings, so their clients and latency estimates are reused
+static std::mutex backends_mutex;
+static std::map<std::string, std::shared_ptr<CredentialBackend>>& backends = *new std::map<std::string, std::shared_ptr<CredentialBackend>>();
+
+static std::set<uid_t> allowed_uids;
+static std::set<std::string> cache_folders;
+// the daemon's name=value settings
+static Options& daemon_opts = *new Options();
+
+std::shared_ptr<CredentialBackend> backend_for(const std::vector<std::string>& args, const Options& opts) {
+  std::string key = args[0] + "\n" + args[1];
+  for(size_t i = 5; i < args.size(); i++) {
+    key += "\n" + args[i];
+  }
+  std::lock_guard<std::mutex> lock(backends_mutex);
+  auto found = backends.find(key);
+  if(found != backends.end()) {
+    return found->second;
+  }
+  LOG(kLogInfo) << "Creating backend for REGION = " << args[0] << ", TABLE = " << args[1];
+  std::shared_ptr<CredentialBackend> backend = make_backend(args[0], args[1], opts);
+  backends[key] = backend;
+  return backend;
+}
+
+// the same as the module does in process, apart from the log level and stats which are the daemon's own
+int authenticate(const AuthdRequest& request, uid_t uid) {
+  if(request.args.size() < 5) {
+    LOG(kLogErr) << "Request has " << request.args.size() << " arguments, expected at least 5";
+    return AUTHD_FAILURE;
+  }
+  std::vector<const char *> argv;
+  for(const auto& arg : request.args) {
+    argv.push_back(arg.c_str());
+  }
+  Options opts;
+  parse_options((int)argv.size(), argv.data(), 5, opts);
+  opts.region = request.args[0];
+  opts.table = request.args[1];
+  // otherwise a client could have answers from a server of its choosing cached for every service on the host
+  if(opts.endpoints != daemon_opts.endpoints || opts.snapshot_path != daemon_opts.snapshot_path) {
+    LOG(kLogWarning) << "Refusing request from uid=" << uid << " with endpoint or snapshot settings other than the daemon's";
+    return AUTHD_UNAVAILABLE;
+  }
+  // or have the daemon create and trust cache files wherever it likes
+  if(cache_folders.empty() ? uid != 0 : cache_folders.count(request.args[3]) == 0) {
+    LOG(kLogWarning) << "Refusing request from uid=" << uid << " for cache folder " << request.args[3];
+    return AUTHD_UNAVAILABLE;
+  }
+
+  const std::string& realm = request.args[2];
+  int cache_dur = atoi(request.args[4].c_str());
+  LOG(kLogInfo) << "REGION = " << request.args[0] << ", TABLE = " << request.args[1] << ", REALM = " << realm << ", USER = " << request.username;
+
+  User u(backend_for(request.args, opts), realm, request.args[3], cache_dur, request.username, opts);
+  return authd_result(u.check_password(request.password));
+}
+
+void handle_connection(int fd) {
+  struct ucred peer;
+  socklen_t peer_length = sizeof(peer);
+  if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 || allowed_uids.count(peer.uid) == 0) {
+    LOG(kLogWarning) << "Refusing connection from uid=" << peer.uid << ", pid=" << peer.pid;
+    return;
+  }
+
+  AuthdHeader header;
+  if(!authd_read(fd, &header, sizeof(header))) {
+    // e.g. another daemon checking whether we are running
+    LOG(kLogDebug) << "No request from pid=" << peer.pid;
+    return;
+  }
+  if(header.magic != kAuthdMagic || header.value > kAuthdMaxRequest) {
+    LOG(kLogWarning) << "Bad request from pid=" << peer.pid;
+    return;
+  }
+  char body[kAuthdMaxRequest];
+  AuthdRequest request;
+  bool decoded = authd_read(fd, body, header.value) && authd_decode(body, header.value, request);
+  // the body holds the password
+  explicit_bzero(body, header.value);
+  if(!decoded) {
+    LOG(kLogWarning) << "Bad request from pid=" << peer.pid;
+    return;
+  }
+
+  AuthdHeader reply = { kAuthdMagic, (uint32_t)authenticate(request, peer.uid) };
+  if(!authd_write(fd, &reply, sizeof(reply))) {
+    LOG(kLogWarning) << "Could not answer pid=" << peer.pid;
+  }
+}
+
+void worker() {
+  while(true) {
+    int fd;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      queue_cv.wait(lock, []() { return !queue.empty() || !running; });
+      if(queue.empty()) {
+        return;
+      }
+      fd = queue.front();
+      queue.pop_front();
+    }
+    handle_connection(fd);
+    close(fd);
+    log_flush();
+  }
+}
+
+// binds the socket, replacing a file left behind by a daemon which has gone but not one which is still running
+int listen_on(const std::string& path) {
+  struct sockaddr_un addr;
+  if(path.length() >= sizeof(addr.sun_path)) {
+    LOG(kLogErr) << "Socket path is too long: " << path;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.length());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    LOG(kLogErr) << "Could not create socket: " << ErrnoString(errno);
+    return -1;
+  }
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    LOG(kLogErr) << "Another daemon is already listening on " << path;
+    close(fd);
+    return -1;
+  }
+  unlink(path.c_str());
+  // anyone may connect, who is let in is decided from the peer credentials
+  mode_t old_mask = umask(0111);
+  bool bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(old_mask);
+  if(!bound || listen(fd, 128) != 0) {
+    LOG(kLogErr) << "Could not listen on " << path << ": " << ErrnoString(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " SOCKET [--threads N] [--allow-uid UID ...] [--cache-folder DIR ...] [name=value ...]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-authd", LOG_DAEMON, LOG_PID | LOG_PERROR);
+
+  std::string socket_path(argv[1]);
+  int threads = 16;
+  allowed_uids.insert(0);
+  allowed_uids.insert(geteuid());
+  int first_option = 2;
+  while(first_option + 1 < argc && strncmp(argv[first_option], "--", 2) == 0) {
+    if(strcmp(argv[first_option], "--threads") == 0) {
+      threads = atoi(argv[first_option + 1]);
+    } else if(strcmp(argv[first_option], "--allow-uid") == 0) {
+      allowed_uids.insert((uid_t)atoi(argv[first_option + 1]));
+    } else if(strcmp(argv[first_option], "--cache-folder") == 0) {
+      cache_folders.insert(argv[first_option + 1]);
+    } else {
+      std::cerr << "Unknown flag " << argv[first_option] << std::endl;
+      return 2;
+    }
+    first_option += 2;
+  }
+  if(threads < 1) {
+    std::cerr << "--threads must be at least 1" << std::endl;
+    return 2;
+  }
+  Options& opts = daemon_opts;
+  parse_options(argc, argv, first_option, opts);
+  log_set_level(opts.log_level);
+  stats_set_enabled(opts.stats != 0);
+
+  // no SA_RESTART, so accept returns when we are asked to stop
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = listen_on(socket_path);
+  if(listen_fd < 0) {
+    return 1;
+  }
+  LOG(kLogInfo) << "Listening on " << socket_path << " with " << threads << " threads";
+  log_flush();
+
+  std::vector<std::thread> workers;
+  for(int i = 0; i < threads; i++) {
+    workers.push_back(std::thread(worker));
+  }
+
+  while(running) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(errno != EINTR) {
+        LOG(kLogErr) << "accept failed: " << ErrnoString(errno);
+        sleep(1);
+      }
+      continue;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = kRequestTimeoutMs / 1000;
+    timeout.tv_usec = (kRequestTimeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      if(queue.size() >= kMaxQueuedConnections) {
+        LOG(kLogWarning) << "Too many connections waiting, closing a new one";
+        close(fd);
+        continue;
+      }
+      queue.push_back(fd);
+    }
+    queue_cv.notify_one();
+  }
+
+  LOG(kLogInfo) << "Stopping";
+  close(listen_fd);
+  unlink(socket_path.c_str());
+  // finish the connections already accepted, taking the lock so a worker cannot miss that running has changed
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+  }
+  queue_cv.notify_all();
+  for(auto& thread : workers) {
+    thread.join();
+  }
+  return 0;
+}
\ No newline at end of file
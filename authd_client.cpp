@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Authd.h"
+#include "Log.h"
+#include "User.h"
+
+static bool put_field(std::string& body, const std::string& field) {
+  if(field.length() > 0xffff) {
+    return false;
+  }
+  uint16_t length = (uint16_t)field.length();
+  body.append((const char *)&length, sizeof(length));
+  body.append(field);
+  return true;
+}
+
+static bool get_field(const char *body, size_t length, size_t& offset, std::string& field) {
+  uint16_t field_length;
+  if(length - offset < sizeof(field_length)) {
+    return false;
+  }
+  memcpy(&field_length, body + offset, sizeof(field_length));
+  offset += sizeof(field_length);
+  if(length - offset < field_length) {
+    return false;
+  }
+  field.assign(body + offset, field_length);
+  offset += field_length;
+  return true;
+}
+
+bool authd_encode(const AuthdRequest& request, std::string& body) {
+  body.clear();
+  if(request.args.size() > 0xffff) {
+    return false;
+  }
+  uint16_t count = (uint16_t)request.args.size();
+  body.append((const char *)&count, sizeof(count));
+  for(const auto& arg : request.args) {
+    if(!put_field(body, arg)) {
+      return false;
+    }
+  }
+  return put_field(body, request.username) && put_field(body, request.password) && body.length() <= kAuthdMaxRequest;
+}
+
+bool authd_decode(const char *body, size_t length, AuthdRequest& request) {
+  uint16_t count;
+  if(length < sizeof(count)) {
+    return false;
+  }
+  memcpy(&count, body, sizeof(count));
+  size_t offset = sizeof(count);
+  request.args.resize(count);
+  for(auto& arg : request.args) {
+    if(!get_field(body, length, offset, arg)) {
+      return false;
+    }
+  }
+  return get_field(body, length, offset, request.username) && get_field(body, length, offset, request.password) &&
+         offset == length;
+}
+
+int authd_result(int status) {
+  if(status == AUTH_ACCEPTED) {
+    return AUTHD_SUCCESS;
+  }
+  return status == AUTH_USER_LIMITED ? AUTHD_MAXTRIES : AUTHD_FAILURE;
+}
+
+bool authd_read(int fd, void *buffer, size_t length) {
+  char *at = (char *)buffer;
+  while(length > 0) {
+    ssize_t got = recv(fd, at, length, 0);
+    if(got < 0 && errno == EINTR) {
+      continue;
+    }
+    if(got <= 0) {
+      return false;
+    }
+    at += got;
+    length -= got;
+  }
+  return true;
+}
+
+bool authd_write(int fd, const void *buffer, size_t length) {
+  const char *at = (const char *)buffer;
+  while(length > 0) {
+    // MSG_NOSIGNAL so a daemon going away gives an error rather than SIGPIPE in the host process
+    ssize_t sent = send(fd, at, length, MSG_NOSIGNAL);
+    if(sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if(sent <= 0) {
+      return false;
+    }
+    at += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// connects to the daemon and checks who is running it, returns -1 if it cannot be used
+static int connect_authd(const std::string& socket_path, int timeout_ms) {
+  struct sockaddr_un addr;
+  if(socket_path.length() >= sizeof(addr.sun_path)) {
+    LOG(kLogErr) << "authd socket path is too long: " << socket_path;
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    return -1;
+  }
+  struct timeval timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path.c_str(), socket_path.length());
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    LOG(kLogDebug) << "Could not connect to authd at " << socket_path << ": " << ErrnoString(errno);
+    close(fd);
+    return -1;
+  }
+
+  // the daemon decides whether a login succeeds, so only trust one run by root or by us
+  struct ucred peer;
+  socklen_t peer_length = sizeof(peer);
+  if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 || (peer.uid != 0 && peer.uid != geteuid())) {
+    LOG(kLogErr) << "Not trusting authd at " << socket_path << " as it is run by uid=" << peer.uid;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int authd_authenticate(const std::string& socket_path, int timeout_ms, int argc, const char **argv,
+                       const std::string& username, const std::string& password) {
+  AuthdRequest request;
+  request.args.assign(argv, argv + argc);
+  request.username = username;
+  request.password = password;
+  std::string body;
+  if(!authd_encode(request, body)) {
+    LOG(kLogWarning) << "Request is too large for authd";
+    return AUTHD_UNAVAILABLE;
+  }
+
+  int fd = connect_authd(socket_path, timeout_ms);
+  if(fd < 0) {
+    return AUTHD_UNAVAILABLE;
+  }
+  AuthdHeader header = { kAuthdMagic, (uint32_t)body.length() };
+  AuthdHeader reply;
+  bool sent = authd_write(fd, &header, sizeof(header)) && authd_write(fd, body.data(), body.length());
+  errno = 0;
+  bool answered = sent && authd_read(fd, &reply, sizeof(reply));
+  bool timed_out = sent && !answered && (errno == EAGAIN || errno == EWOULDBLOCK);
+  close(fd);
+  // the body holds the password
+  explicit_bzero(&body[0], body.length());
+
+  if(timed_out) {
+    // the daemon has the request and is most likely still waiting on a slow backend, asking it again from here
+    // would only double the load on it
+    LOG(kLogWarning) << "authd at " << socket_path << " did not answer within " << timeout_ms << "ms, failing the login";
+    return AUTHD_FAILURE;
+  }
+  if(!answered || reply.magic != kAuthdMagic || reply.value == AUTHD_UNAVAILABLE || reply.value > AUTHD_MAXTRIES) {
+    LOG(kLogWarning) << "No answer from authd at " << socket_path;
+    return AUTHD_UNAVAILABLE;
+  }
+  return (int)reply.value;
+}
\ No newline at end of file
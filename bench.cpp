@@ -0,0 +1,471 @@
+// pam-dynamo-bench, microbenchmarks for the module's components
+//
+// usage: pam-dynamo-bench [google benchmark flags, e.g. --benchmark_filter=cache]
+//
+// as well as the usual timings each benchmark reports p50/p99/p999 latency in nanoseconds and the number of
+// C++ heap allocations per operation, cache files are created in a temporary folder and the shared memory cache and
+// stats use segments of their own, all of which are removed afterwards, so a live host's caches are not touched
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+#include <openssl/evp.h>
+
+#include "Cache.h"
+#include "CacheRecord.h"
+#include "CallContext.h"
+#include "CredentialBackend.h"
+#include "Digest.h"
+#include "Log.h"
+#include "SegmentOwner.h"
+#include "ShmCache.h"
+#include "SnapshotBackend.h"
+#include "Stats.h"
+#include "User.h"
+
+// counts the C++ heap allocations made by threads while they are inside a Sample, anything else (benchmark setup,
+// the library's own bookkeeping) is passed straight through
+static std::atomic<long> allocations(0);
+static thread_local bool counting_allocations = false;
+
+void *operator new(size_t size) {
+  if(counting_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void *p = malloc(size ? size : 1);
+  if(p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+// times each iteration so percentiles can be reported, and counts allocations made inside the iterations
+class LatencyRecorder {
+  public:
+    explicit LatencyRecorder(benchmark::State& p_state) : state(p_state) {
+      samples.reserve(state.max_iterations < 10000000 ? state.max_iterations : 10000000);
+      allocations_at_start = allocations.load();
+    }
+
+    ~LatencyRecorder() {
+      long allocated = allocations.load() - allocations_at_start;
+      state.counters["allocs/op"] = benchmark::Counter((double)allocated, benchmark::Counter::kAvgIterations);
+      if(samples.empty()) {
+        return;
+      }
+      std::sort(samples.begin(), samples.end());
+      state.counters["p50_ns"] = percentile(0.50);
+      state.counters["p99_ns"] = percentile(0.99);
+      state.counters["p999_ns"] = percentile(0.999);
+    }
+
+    void start() {
+      started = std::chrono::steady_clock::now();
+    }
+
+    void stop() {
+      if(samples.size() < samples.capacity()) {
+        samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count());
+      }
+    }
+
+  private:
+    double percentile(double p) {
+      return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+    }
+
+    benchmark::State& state;
+    std::vector<double> samples;
+    long allocations_at_start;
+    std::chrono::steady_clock::time_point started;
+};
+
+// times one iteration and counts its allocations
+class Sample {
+  public:
+    explicit Sample(LatencyRecorder& p_recorder) : recorder(p_recorder) {
+      recorder.start();
+      counting_allocations = true;
+    }
+    ~Sample() {
+      counting_allocations = false;
+      recorder.stop();
+    }
+  private:
+    LatencyRecorder& recorder;
+};
+
+static std::string cache_dir;
+static const std::string REALM = "bench";
+static const std::string SALT = "4b1d6a0c9e2f4d7a";
+static const std::string PASSWORD = "correct horse battery staple";
+
+std::string hashed(const std::string& salt, const std::string& password) {
+  HexDigest digest;
+  hash_password(salt, password, digest);
+  return digest.str();
+}
+
+// the hashing code as it was before Digest.h, kept as a baseline to compare against
+bool legacy_hash_password(const std::string& unhashed, std::string& hashed) {
+  bool success = false;
+  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+  if(mdctx != NULL) {
+    if(EVP_DigestInit_ex(mdctx, EVP_sha3_256(), NULL) && EVP_DigestUpdate(mdctx, unhashed.c_str(), unhashed.length())) {
+      unsigned char hash[EVP_MAX_MD_SIZE];
+      unsigned int lengthOfHash = 0;
+      if(EVP_DigestFinal_ex(mdctx, hash, &lengthOfHash)) {
+        std::stringstream ss;
+        for(unsigned int i = 0; i < lengthOfHash; ++i) {
+          ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+        }
+        hashed = ss.str();
+        success = true;
+      }
+    }
+    EVP_MD_CTX_free(mdctx);
+  }
+  return success;
+}
+
+// hashing
+
+static void BM_hash_password_legacy(benchmark::State& state) {
+  LatencyRecorder recorder(state);
+  std::string result;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    legacy_hash_password(SALT + PASSWORD, result);
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_hash_password_legacy);
+
+static void BM_hash_password(benchmark::State& state) {
+  LatencyRecorder recorder(state);
+  HexDigest result;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    hash_password(SALT, PASSWORD, result);
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_hash_password);
+
+static void BM_digest_matches(benchmark::State& state) {
+  LatencyRecorder recorder(state);
+  HexDigest result;
+  hash_password(SALT, PASSWORD, result);
+  std::string stored = result.str();
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(digest_matches(stored, result));
+  }
+}
+BENCHMARK(BM_digest_matches);
+
+// cache, arg 0 is 1 for a salted record and arg 1 is the number of shared memory cache slots (0 for sqlite only)
+
+Options cache_options(benchmark::State& state) {
+  Options opts;
+  opts.shm_cache_slots = state.range(1);
+  return opts;
+}
+
+void seed_user(Cache& c, const std::string& username, bool salted) {
+  if(salted) {
+    c.save_in_cache_w_salt(username, hashed(SALT, PASSWORD), SALT);
+  } else {
+    c.save_in_cache(username, hashed("", PASSWORD));
+  }
+}
+
+static void BM_cache_lookup_hit(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, cache_options(state));
+  seed_user(c, "hit", state.range(0));
+  LatencyRecorder recorder(state);
+  CacheRecord record;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(c.lookup("hit", record));
+  }
+}
+BENCHMARK(BM_cache_lookup_hit)->Args({0, 0})->Args({1, 0})->Args({0, 4096})->Args({1, 4096});
+
+// the process cache in front of sqlite, arg 0 is 1 for a salted record and arg 1 is its size in KB
+Options process_options(benchmark::State& state) {
+  Options opts;
+  opts.process_cache_kb = state.range(1);
+  return opts;
+}
+
+static void BM_cache_lookup_hit_process(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, process_options(state));
+  seed_user(c, "hit", state.range(0));
+  LatencyRecorder recorder(state);
+  CacheRecord record;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(c.lookup("hit", record));
+  }
+}
+BENCHMARK(BM_cache_lookup_hit_process)->Args({0, 1024})->Args({1, 1024});
+
+static void BM_cache_lookup_miss(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, cache_options(state));
+  LatencyRecorder recorder(state);
+  CacheRecord record;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(c.lookup("nobody", record));
+  }
+}
+BENCHMARK(BM_cache_lookup_miss)->Args({0, 0})->Args({0, 4096});
+
+static void BM_cache_check_cache(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, cache_options(state));
+  seed_user(c, "check", state.range(0));
+  std::string password = state.range(0) ? hashed(SALT, PASSWORD) : hashed("", PASSWORD);
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(c.check_cache("check", password));
+  }
+}
+BENCHMARK(BM_cache_check_cache)->Args({0, 0})->Args({1, 0})->Args({0, 4096})->Args({1, 4096});
+
+static void BM_cache_get_user_from_cache(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, cache_options(state));
+  seed_user(c, "salt", state.range(0));
+  LatencyRecorder recorder(state);
+  std::string salt;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(c.get_user_from_cache("salt", salt));
+  }
+}
+BENCHMARK(BM_cache_get_user_from_cache)->Args({0, 0})->Args({1, 0})->Args({0, 4096})->Args({1, 4096});
+
+static void BM_cache_save(benchmark::State& state) {
+  Cache c(REALM, cache_dir, 3600, cache_options(state));
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    Sample sample(recorder);
+    seed_user(c, "save", state.range(0));
+  }
+}
+BENCHMARK(BM_cache_save)->Args({0, 0})->Args({1, 0})->Args({0, 4096})->Args({1, 4096});
+
+// saves handed to the background writer, arg 0 is the number of distinct users saved in turn
+static void BM_cache_save_write_behind(benchmark::State& state) {
+  Options opts;
+  opts.cache_write_behind = 1;
+  Cache c("writebehind", cache_dir, 3600, opts);
+  LatencyRecorder recorder(state);
+  long n = 0;
+  for(auto _ : state) {
+    std::string username = "user" + std::to_string(n++ % state.range(0));
+    Sample sample(recorder);
+    c.save_in_cache(username, hashed("", PASSWORD));
+  }
+}
+BENCHMARK(BM_cache_save_write_behind)->Arg(1)->Arg(512);
+
+// concurrent writers, arg 0 is the number of cache shards
+static void BM_cache_save_parallel(benchmark::State& state) {
+  Options opts;
+  opts.cache_shards = state.range(0);
+  Cache c("parallel" + std::to_string(state.range(0)), cache_dir, 3600, opts);
+  std::string prefix = "writer" + std::to_string(state.thread_index()) + "_";
+  LatencyRecorder recorder(state);
+  long n = 0;
+  for(auto _ : state) {
+    std::string username = prefix + std::to_string(n++ % 64);
+    Sample sample(recorder);
+    c.save_in_cache(username, hashed("", PASSWORD));
+  }
+}
+BENCHMARK(BM_cache_save_parallel)->Arg(1)->Arg(4)->Threads(4)->UseRealTime();
+
+// a realm whose database has never been opened, so this includes creating the file and schema
+static void BM_cache_lookup_cold_file(benchmark::State& state) {
+  Options opts = cache_options(state);
+  LatencyRecorder recorder(state);
+  CacheRecord record;
+  long n = 0;
+  for(auto _ : state) {
+    std::string realm = "cold" + std::to_string(n++);
+    Sample sample(recorder);
+    Cache c(realm, cache_dir, 3600, opts);
+    benchmark::DoNotOptimize(c.lookup("nobody", record));
+  }
+}
+BENCHMARK(BM_cache_lookup_cold_file)->Args({0, 0})->Iterations(200);
+
+// backends, arg 0 is the number of users in the snapshot
+
+static void BM_snapshot_fetch(benchmark::State& state) {
+  std::vector<SnapshotRecord> records;
+  CacheRecord record;
+  record.password = hashed(SALT, PASSWORD);
+  record.salt = SALT;
+  record.salted = true;
+  for(long i = 0; i < state.range(0); i++) {
+    records.push_back(SnapshotRecord{ REALM, "user" + std::to_string(i), record });
+  }
+  std::string path = cache_dir + "/snapshot_" + std::to_string(state.range(0));
+  size_t skipped = 0;
+  write_snapshot(path, records, skipped);
+  SnapshotBackend backend(path);
+  std::vector<std::string> usernames;
+  for(long i = 0; i < 1024; i++) {
+    usernames.push_back("user" + std::to_string((i * 7919) % state.range(0)));
+  }
+  LatencyRecorder recorder(state);
+  size_t n = 0;
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(backend.fetch(REALM, usernames[n++ % usernames.size()], record));
+  }
+}
+BENCHMARK(BM_snapshot_fetch)->Arg(1000)->Arg(1000000);
+
+// authentication against a fake backend
+
+// every user called auth* exists with PASSWORD, anyone else is unknown
+std::shared_ptr<CredentialBackend> fake_backend() {
+  std::shared_ptr<MemoryBackend> backend = std::make_shared<MemoryBackend>();
+  CacheRecord record;
+  record.password = hashed(SALT, PASSWORD);
+  record.salt = SALT;
+  record.salted = true;
+  for(const char *username : { "auth_hit", "auth_miss", "auth_bad" }) {
+    backend->add(REALM, username, record);
+  }
+  for(int i = 0; i < 64; i++) {
+    backend->add(REALM, "auth_par" + std::to_string(i), record);
+  }
+  return backend;
+}
+
+User fake_user(const std::string& username, const Options& opts) {
+  return User(fake_backend(), REALM, cache_dir, 3600, username, opts);
+}
+
+static void BM_authenticate_cache_hit(benchmark::State& state) {
+  Options opts = cache_options(state);
+  User user = fake_user("auth_hit", opts);
+  user.authenticate(PASSWORD);
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(user.authenticate(PASSWORD));
+  }
+}
+BENCHMARK(BM_authenticate_cache_hit)->Args({1, 0})->Args({1, 4096});
+
+static void BM_authenticate_cache_miss(benchmark::State& state) {
+  Options opts = cache_options(state);
+  User user = fake_user("auth_miss", opts);
+  Cache c(REALM, cache_dir, 3600, opts);
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    c.remove_user("auth_miss");
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(user.authenticate(PASSWORD));
+  }
+}
+BENCHMARK(BM_authenticate_cache_miss)->Args({1, 0})->Args({1, 4096});
+
+static void BM_authenticate_bad_password(benchmark::State& state) {
+  Options opts = cache_options(state);
+  User user = fake_user("auth_bad", opts);
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(user.authenticate("wrong"));
+  }
+}
+BENCHMARK(BM_authenticate_bad_password)->Args({1, 0});
+
+static void BM_authenticate_unknown_user(benchmark::State& state) {
+  Options opts = cache_options(state);
+  User user = fake_user("unknown_user", opts);
+  LatencyRecorder recorder(state);
+  for(auto _ : state) {
+    Sample sample(recorder);
+    benchmark::DoNotOptimize(user.authenticate(PASSWORD));
+  }
+}
+BENCHMARK(BM_authenticate_unknown_user)->Args({1, 0});
+
+// whole logins from several threads at once, as a threaded host (e.g. Apache's worker MPM) makes them, each
+// iteration sets up the call the way pam_sm_authenticate does and each thread logs in its own few users
+void authenticate_parallel(benchmark::State& state, Options opts) {
+  static std::shared_ptr<CredentialBackend> backend = fake_backend();
+  // as main sets for the other benchmarks
+  opts.log_level = LOG_ERR;
+  int first_user = state.thread_index() * 4;
+  LatencyRecorder recorder(state);
+  long n = 0;
+  for(auto _ : state) {
+    std::string username = "auth_par" + std::to_string((first_user + n++ % 4) % 64);
+    Sample sample(recorder);
+    CallContext context(opts);
+    User user(backend, REALM, cache_dir, 3600, username, opts);
+    benchmark::DoNotOptimize(user.authenticate(PASSWORD));
+  }
+}
+
+static void BM_authenticate_parallel(benchmark::State& state) {
+  authenticate_parallel(state, cache_options(state));
+}
+BENCHMARK(BM_authenticate_parallel)->Args({1, 0})->Args({1, 4096})->ThreadRange(1, 16)->UseRealTime();
+
+static void BM_authenticate_parallel_process(benchmark::State& state) {
+  authenticate_parallel(state, process_options(state));
+}
+BENCHMARK(BM_authenticate_parallel_process)->Args({1, 1024})->ThreadRange(1, 16)->UseRealTime();
+
+int main(int argc, char **argv) {
+  // only errors, so logging does not end up in the numbers
+  log_init("pam-dynamo-bench", LOG_USER, LOG_PID | LOG_PERROR);
+  log_set_level(LOG_ERR);
+
+  char dir_template[] = "/tmp/pam-dynamo-bench.XXXXXX";
+  if(mkdtemp(dir_template) == NULL) {
+    perror("Could not create temporary cache folder");
+    return 1;
+  }
+  cache_dir = dir_template;
+  std::string shm_name = "/pam-dynamo-bench-cache-" + std::to_string(getpid());
+  std::string stats_name = "/pam-dynamo-bench-stats-" + std::to_string(getpid());
+  shm_cache_set_name(shm_name);
+  stats_set_name(stats_name);
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+
+  shm_unlink(user_object_name(shm_name).c_str());
+  shm_unlink(stats_name.c_str());
+  std::string cleanup = "rm -rf '" + cache_dir + "'";
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
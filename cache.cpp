@@ -1,102 +1,399 @@
 #include <iostream>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <map>
+#include <mutex>
 
 #include <sqlite3.h>
 
 #include "Cache.h"
+#include "Digest.h"
+#include "KeyHash.h"
 #include "Log.h"
+#include "Stats.h"
+#include "WriteBehind.h"
 
+// version of the layout below, kept in PRAGMA user_version, files from before it was versioned are 0
+const int SCHEMA_VERSION = 2;
+
+// the digest is kept as its 32 bytes rather than 64 hex characters (a hash in another format is kept as text) and
+// the rows live in the primary key's b-tree, so a lookup is one probe and a save only updates that and the
+// keep_until index, which the sweep uses
+// the account columns are NULL for rows migrated from the released layout, whose account has to be looked up again
+// keep_until is when the longest lived of the services saving the row stops using it, NULL when no saver knew (rows
+// from pam-dynamo-warm or migrated ones), which only cache_max_rows removes
 const char *CREATE_TABLE_SQL = "CREATE TABLE IF NOT EXISTS users (" \
   "username TEXT NOT NULL PRIMARY KEY," \
-  "password TEXT NOT NULL," \
+  "digest BLOB NOT NULL," \
   "salt TEXT NULL," \
-  "timestamp INT NOT NULL);";
+  "timestamp INT NOT NULL," \
+  "enabled INT NULL," \
+  "expires_at INT NULL," \
+  "user_groups TEXT NULL," \
+  "keep_until INT NULL) WITHOUT ROWID;";
 
-const char *CREATE_INDEX_SQL = "CREATE INDEX IF NOT EXISTS username_idx ON users(username);";
+const char *CREATE_INDEX_SQL = "CREATE INDEX IF NOT EXISTS keep_until_idx ON users(keep_until);";
 
-const char *CHECK_FOR_USER_SQL = "SELECT timestamp FROM users WHERE username=?1 AND password=?2 AND timestamp>?3;";
+// from the released layout (versions 0 and 1: hex password column, a rowid table and a second index on username)
+// the account fields and keep_until are left NULL, so those accounts are looked up again and only cache_max_rows
+// removes the rows, and the negative caches only hold entries for a few minutes so they are started again
+const char *MIGRATE_SQL = "CREATE TABLE users_v2 (" \
+  "username TEXT NOT NULL PRIMARY KEY," \
+  "digest BLOB NOT NULL," \
+  "salt TEXT NULL," \
+  "timestamp INT NOT NULL," \
+  "enabled INT NULL," \
+  "expires_at INT NULL," \
+  "user_groups TEXT NULL," \
+  "keep_until INT NULL) WITHOUT ROWID;" \
+  "INSERT INTO users_v2(username, digest, salt, timestamp) SELECT username, pack_digest(password), salt, timestamp FROM users;" \
+  "DROP TABLE users;" \
+  "ALTER TABLE users_v2 RENAME TO users;" \
+  "DROP TABLE IF EXISTS unknown_users;" \
+  "DROP TABLE IF EXISTS failed_attempts;";
 
-const char *GET_SALT_SQL = "SELECT salt FROM users WHERE username=?1 AND timestamp>?2;";
+// when the database was last swept, shared by every process using it
+const char *CREATE_META_TABLE_SQL = "CREATE TABLE IF NOT EXISTS cache_meta (" \
+  "name TEXT NOT NULL PRIMARY KEY," \
+  "value INT NOT NULL);" \
+  "INSERT OR IGNORE INTO cache_meta(name, value) VALUES('last_sweep', 0);";
 
-const char *ADD_USER_TO_CACHE_SQL = "INSERT INTO users(username, password, salt, timestamp) " \
-  "VALUES(?1, ?2, null, ?3) " \
-  "ON CONFLICT(username) DO UPDATE SET " \
-  "password = ?2, " \
-  "salt = null, " \
-  "timestamp = ?3;";
+// claims the next sweep, changes a row only if nobody has swept within the interval
+const char *CLAIM_SWEEP_SQL = "UPDATE cache_meta SET value = ?1 WHERE name = 'last_sweep' AND value <= ?2;";
+
+// each row carries its own expiry, so services with different durations sharing the file only remove rows which
+// none of them can use
+const char *SWEEP_USERS_SQL = "DELETE FROM users WHERE keep_until <= ?1;";
+
+const char *SWEEP_UNKNOWN_USERS_SQL = "DELETE FROM unknown_users WHERE keep_until <= ?1;";
+
+const char *SWEEP_FAILED_ATTEMPTS_SQL = "DELETE FROM failed_attempts WHERE keep_until <= ?1;";
+
+// keeps the rows which are good for longest, keep_until only moves on when a user is saved (a cache hit leaves it)
+// so the first to go are the least recently saved, rows without one go before any other
+const char *EVICT_USERS_SQL = "DELETE FROM users WHERE username IN " \
+  "(SELECT username FROM users ORDER BY keep_until DESC LIMIT -1 OFFSET ?1);";
 
-  const char *ADD_USER_W_SALT_TO_CACHE_SQL = "INSERT INTO users(username, password, salt, timestamp) " \
-  "VALUES(?1, ?2, ?3, ?4) " \
+// negative cache, users the backend said do not exist and recently rejected (username, password) attempts
+const char *CREATE_NEGATIVE_TABLES_SQL = "CREATE TABLE IF NOT EXISTS unknown_users (" \
+  "username TEXT NOT NULL PRIMARY KEY," \
+  "timestamp INT NOT NULL," \
+  "keep_until INT NOT NULL) WITHOUT ROWID;" \
+  "CREATE TABLE IF NOT EXISTS failed_attempts (" \
+  "username TEXT NOT NULL," \
+  "attempt TEXT NOT NULL," \
+  "timestamp INT NOT NULL," \
+  "keep_until INT NOT NULL," \
+  "PRIMARY KEY(username, attempt)) WITHOUT ROWID;";
+
+const char *LOOKUP_USER_SQL = "SELECT digest, salt, timestamp, enabled, expires_at, user_groups FROM users WHERE username=?1 AND timestamp>?2;";
+
+// the salt is null for an unsalted user
+// keep_until only moves later, either side may be NULL
+const char *ADD_USER_TO_CACHE_SQL = "INSERT INTO users(username, digest, salt, timestamp, enabled, expires_at, user_groups, keep_until) " \
+  "VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8) " \
   "ON CONFLICT(username) DO UPDATE SET " \
-  "password = ?2, " \
+  "digest = ?2, " \
   "salt = ?3, " \
-  "timestamp = ?4;";
+  "timestamp = ?4, " \
+  "enabled = ?5, " \
+  "expires_at = ?6, " \
+  "user_groups = ?7, " \
+  "keep_until = MAX(IFNULL(keep_until, ?8), IFNULL(?8, keep_until));";
+
+const char *REMOVE_USER_SQL = "DELETE FROM users WHERE username=?1;";
+
+const char *UPDATE_USER_SQL = "UPDATE users SET digest = ?2, salt = ?3, timestamp = ?4, enabled = ?5, expires_at = ?6, user_groups = ?7, " \
+  "keep_until = MAX(IFNULL(keep_until, ?8), IFNULL(?8, keep_until)) WHERE username=?1;";
+
+const char *CHECK_UNKNOWN_USER_SQL = "SELECT timestamp FROM unknown_users WHERE username=?1 AND timestamp>?2;";
+
+const char *ADD_UNKNOWN_USER_SQL = "INSERT INTO unknown_users(username, timestamp, keep_until) VALUES(?1, ?2, ?3) " \
+  "ON CONFLICT(username) DO UPDATE SET timestamp = ?2, keep_until = MAX(keep_until, ?3);";
+
+const char *CHECK_FAILED_ATTEMPT_SQL = "SELECT timestamp FROM failed_attempts WHERE username=?1 AND attempt=?2 AND timestamp>?3;";
 
-Cache::Cache(std::string p_realm, std::string p_directory, int p_session_duration) {
+const char *ADD_FAILED_ATTEMPT_SQL = "INSERT INTO failed_attempts(username, attempt, timestamp, keep_until) VALUES(?1, ?2, ?3, ?4) " \
+  "ON CONFLICT(username, attempt) DO UPDATE SET timestamp = ?3, keep_until = MAX(keep_until, ?4);";
+
+const char *FORGET_UNKNOWN_USER_SQL = "DELETE FROM unknown_users WHERE username=?1;";
+
+const char *FORGET_FAILED_ATTEMPTS_SQL = "DELETE FROM failed_attempts WHERE username=?1;";
+
+const char *CLEAR_SQL = "DELETE FROM users; DELETE FROM unknown_users; DELETE FROM failed_attempts;";
+
+Cache::Cache(std::string p_realm, std::string p_directory, int p_session_duration, Options p_opts)
+  : scope(cache_scope(p_directory, p_opts)), local(p_opts.process_cache_kb, p_opts.process_cache_ttl, scope), shm(p_opts.shm_cache_slots, scope) {
   realm = p_realm;
+  opts = p_opts;
   directory = p_directory;
   session_duration = p_session_duration;
+  if(opts.cache_shards < 1) {
+    opts.cache_shards = 1;
+  }
+  dbs.assign(opts.cache_shards, NULL);
+}
+
+// a cache database connection which is kept open for the life of the process
+// the schema is checked once when it is opened and the statements are prepared once and reset after each use
+struct CacheDb {
+  sqlite3 *conn;
+  sqlite3_stmt *lookup_user;
+  sqlite3_stmt *add_user;
+  sqlite3_stmt *remove_user;
+  sqlite3_stmt *update_user;
+  sqlite3_stmt *check_unknown_user;
+  sqlite3_stmt *add_unknown_user;
+  sqlite3_stmt *check_failed_attempt;
+  sqlite3_stmt *add_failed_attempt;
+  sqlite3_stmt *forget_unknown_user;
+  sqlite3_stmt *forget_failed_attempts;
+  // when this process should next try to claim a sweep
+  time_t next_sweep_check;
+  pid_t pid;
+  std::mutex lock;
+};
+
+// open connections keyed by database file path
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::mutex cache_dbs_mutex;
+static std::map<std::string, CacheDb*>& cache_dbs = *new std::map<std::string, CacheDb*>();
+
+bool prep_stmt(sqlite3 *db, sqlite3_stmt **stmt, const char *sql) {
+  int rc = 0;
+  rc = sqlite3_prepare_v3(db, sql, strlen(sql), SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+  if(rc != SQLITE_OK) {
+    LOG(kLogErr) << "Failed to prepare statement, error code=" << rc << ", error message=" << sqlite3_errmsg(db);
+    return false;
+  }
+  return true;
+}
+
+void close_cache_db(CacheDb *cdb) {
+  // finalize is a no-op for statements which were never prepared
+  sqlite3_finalize(cdb->lookup_user);
+  sqlite3_finalize(cdb->add_user);
+  sqlite3_finalize(cdb->remove_user);
+  sqlite3_finalize(cdb->update_user);
+  sqlite3_finalize(cdb->check_unknown_user);
+  sqlite3_finalize(cdb->add_unknown_user);
+  sqlite3_finalize(cdb->check_failed_attempt);
+  sqlite3_finalize(cdb->add_failed_attempt);
+  sqlite3_finalize(cdb->forget_unknown_user);
+  sqlite3_finalize(cdb->forget_failed_attempts);
+  sqlite3_close(cdb->conn);
+  delete cdb;
+}
+
+// a single shard keeps the original file name, so turning sharding on or off just starts new files
+std::string cache_db_path(const std::string& p_dir, const std::string& p_realm, int shard, int shards) {
+  if(shards <= 1) {
+    return p_dir + "/" + p_realm + "_cache.db";
+  }
+  return p_dir + "/" + p_realm + "_cache_" + std::to_string(shard) + ".db";
+}
+
+// runs a statement which takes no binds, for the pragmas
+bool exec_sql(sqlite3 *db, const std::string& sql, const char *what) {
+  char *zErrMsg = 0;
+  if(sqlite3_exec(db, sql.c_str(), NULL, 0, &zErrMsg) != SQLITE_OK) {
+    LOG(kLogWarning) << "Could not " << what << ": " << zErrMsg;
+    sqlite3_free(zErrMsg);
+    return false;
+  }
+  return true;
+}
+
+// the cache can always be refilled from the backend, so trade durability for speed
+void tune_connection(sqlite3 *db, const Options& opts) {
+  // wait for other writers rather than failing straight away with SQLITE_BUSY
+  sqlite3_busy_timeout(db, opts.cache_busy_timeout_ms);
+  if(opts.cache_wal) {
+    // readers do not block the writer and the writer does not block readers, needs a local filesystem
+    exec_sql(db, "PRAGMA journal_mode=WAL;", "switch to WAL mode");
+  }
+  // with WAL a crash can lose the last few commits but not corrupt the file, that is fine for a cache
+  exec_sql(db, "PRAGMA synchronous=NORMAL;", "relax synchronous");
+  if(opts.cache_mmap_mb > 0) {
+    exec_sql(db, "PRAGMA mmap_size=" + std::to_string((long long)opts.cache_mmap_mb * 1024 * 1024) + ";", "set mmap_size");
+  }
 }
 
-bool check_and_init(std::string p_dir, std::string p_realm, sqlite3 **db) {
+// runs a query which returns one integer, e.g. a pragma, returns fallback if it fails or returns no rows
+int query_int(sqlite3 *db, const char *sql, int fallback) {
+  sqlite3_stmt *stmt = NULL;
+  int value = fallback;
+  if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    value = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+// pack_digest(text) for the migration, hex digests become their bytes and anything else is left as it is
+static void pack_digest(sqlite3_context *context, int, sqlite3_value **argv) {
+  unsigned char bytes[kDigestSize];
+  const unsigned char *text = sqlite3_value_text(argv[0]);
+  if(sqlite3_value_type(argv[0]) == SQLITE_TEXT && digest_to_bytes((const char*)text, bytes)) {
+    sqlite3_result_blob(context, bytes, kDigestSize, SQLITE_TRANSIENT);
+  } else {
+    sqlite3_result_value(context, argv[0]);
+  }
+}
+
+// creates the tables in a new file or brings an older one up to SCHEMA_VERSION, an up to date file costs one read
+// of the version, the version is checked again once the write lock is held so only one process does the work
+bool init_schema(sqlite3 *db) {
+  int version = query_int(db, "PRAGMA user_version;", -1);
+  if(version == SCHEMA_VERSION) {
+    return true;
+  }
+  if(!exec_sql(db, "BEGIN IMMEDIATE;", "start schema update")) {
+    return false;
+  }
+  bool success = true;
+  version = query_int(db, "PRAGMA user_version;", -1);
+  if(version < 0 || version > SCHEMA_VERSION) {
+    LOG(kLogErr) << "Cache database has schema version " << version << ", this module only knows up to " << SCHEMA_VERSION;
+    success = false;
+  } else if(version < SCHEMA_VERSION) {
+    if(query_int(db, "SELECT count(*) FROM sqlite_master WHERE type='table' AND name='users';", 0) > 0) {
+      LOG(kLogInfo) << "Migrating cache database to schema version " << SCHEMA_VERSION;
+      success = sqlite3_create_function(db, "pack_digest", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, pack_digest, NULL, NULL) == SQLITE_OK &&
+        exec_sql(db, MIGRATE_SQL, "migrate cache");
+    }
+    success = success &&
+      exec_sql(db, CREATE_TABLE_SQL, "create table") &&
+      exec_sql(db, CREATE_INDEX_SQL, "create index") &&
+      exec_sql(db, CREATE_NEGATIVE_TABLES_SQL, "create negative cache tables") &&
+      exec_sql(db, CREATE_META_TABLE_SQL, "create meta table") &&
+      exec_sql(db, "PRAGMA user_version=" + std::to_string(SCHEMA_VERSION) + ";", "set schema version");
+  }
+  exec_sql(db, success ? "COMMIT;" : "ROLLBACK;", "end schema update");
+  return success;
+}
+
+bool check_and_init(std::string p_dir, std::string p_realm, int shard, const Options& opts, CacheDb **cdb) {
   // creates sqlite3 db if missing
   // checks if user table exists and if not creates it
   int rc = 0;
-  char *zErrMsg = 0;
 
-  std::string db_filepath = p_dir + "/" + p_realm + "_cache.db";
-  rc = sqlite3_open(db_filepath.c_str(), db);
+  std::string db_filepath = cache_db_path(p_dir, p_realm, shard, opts.cache_shards);
+
+  std::lock_guard<std::mutex> lock(cache_dbs_mutex);
+  auto found = cache_dbs.find(db_filepath);
+  if(found != cache_dbs.end()) {
+    if(found->second->pid == getpid()) {
+      *cdb = found->second;
+      return(true);
+    }
+    // sqlite connections must not be used across a fork, so leave the parent's connection alone and open our own
+    LOG(kLogInfo) << "Process forked, reopening database: " << db_filepath;
+    cache_dbs.erase(found);
+  }
+
+  CacheDb *new_db = new CacheDb();
+  new_db->pid = getpid();
+  new_db->next_sweep_check = 0;
+  rc = sqlite3_open(db_filepath.c_str(), &new_db->conn);
   if(rc) {
     // there was an issue
-    std::clog << kLogErr << "Can't open database: " << sqlite3_errmsg(*db) << std::endl;
+    LOG(kLogErr) << "Can't open database: " << sqlite3_errmsg(new_db->conn);
+    close_cache_db(new_db);
     return(false);
-  } else {
-    std::clog << kLogInfo << "Connected to database: " << db_filepath << std::endl;
-    // we are connected, now check for table and create
-    rc = sqlite3_exec(*db, CREATE_TABLE_SQL, NULL, 0, &zErrMsg);
-    if(rc != SQLITE_OK) {
-      std::clog << kLogErr << "Error creating table: " << zErrMsg << std::endl;
-      sqlite3_free(zErrMsg);
-      return(false);
-    }
-    // we created the table, now create the index
-    rc = sqlite3_exec(*db, CREATE_INDEX_SQL, NULL, 0, &zErrMsg);
-    if(rc != SQLITE_OK) {
-      std::clog << kLogErr << "Error creating index: " << zErrMsg << std::endl;
-      sqlite3_free(zErrMsg);
-      return(false);
+  }
+  LOG(kLogInfo) << "Connected to database: " << db_filepath;
+  tune_connection(new_db->conn, opts);
+  // we are connected, now create or update the tables
+  if(!init_schema(new_db->conn)) {
+    close_cache_db(new_db);
+    return(false);
+  }
+  // prepare the statements we will reuse
+  if(!prep_stmt(new_db->conn, &new_db->lookup_user, LOOKUP_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->add_user, ADD_USER_TO_CACHE_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->remove_user, REMOVE_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->update_user, UPDATE_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->check_unknown_user, CHECK_UNKNOWN_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->add_unknown_user, ADD_UNKNOWN_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->check_failed_attempt, CHECK_FAILED_ATTEMPT_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->add_failed_attempt, ADD_FAILED_ATTEMPT_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->forget_unknown_user, FORGET_UNKNOWN_USER_SQL) ||
+     !prep_stmt(new_db->conn, &new_db->forget_failed_attempts, FORGET_FAILED_ATTEMPTS_SQL)) {
+    close_cache_db(new_db);
+    return(false);
+  }
+  // all done, keep it for next time
+  cache_dbs[db_filepath] = new_db;
+  *cdb = new_db;
+  return(true);
+}
+
+// runs when the process exits
+__attribute__((destructor))
+static void close_cache_dbs() {
+  // queued writes go out first, while the connections are still open
+  flush_cache_writes();
+  std::lock_guard<std::mutex> lock(cache_dbs_mutex);
+  for(auto& entry : cache_dbs) {
+    if(entry.second->pid == getpid()) {
+      close_cache_db(entry.second);
     }
-    // all done, return true
-    return(true);
   }
+  cache_dbs.clear();
 }
 
-bool prep_stmt(sqlite3 **db, sqlite3_stmt **stmt, const char *sql) {
+// resets a reused statement (and drops its binds) when it goes out of scope
+class StmtReset {
+  public:
+    explicit StmtReset(sqlite3_stmt *p_stmt) : stmt(p_stmt) {}
+    ~StmtReset() {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+    }
+  private:
+    sqlite3_stmt *stmt;
+};
+
+bool add_text_bind(sqlite3_stmt *stmt, int index, const std::string& text, const char *field_name) {
   int rc = 0;
-  rc = sqlite3_prepare_v2(*db, sql, strlen(sql), stmt, NULL);
+  // the statement is always reset before the bound string goes away, so sqlite does not need its own copy
+  rc = sqlite3_bind_text(stmt, index, text.c_str(), text.length(), SQLITE_STATIC);
   if(rc != SQLITE_OK) {
-    std::clog << kLogErr << "Failed to prepare statement, error code=" << rc << ", error message=" << sqlite3_errmsg(*db) << std::endl;
-    return false;
+    LOG(kLogErr) << "Unable to bind @index=" << index << " field_name=" << field_name;
+    return(false);
   }
-  return true;
+  return(true);
 }
 
-bool add_text_bind(sqlite3_stmt *stmt, int index, std::string text, const char *field_name) {
-  int rc = 0;
-  rc = sqlite3_bind_text(stmt, index, text.c_str(), -1, SQLITE_TRANSIENT);
-  if(rc != SQLITE_OK) {
-    std::clog << kLogErr << "Unable to bind @index=" << index << " field_name=" << field_name << std::endl;
+// binds a hex digest as its kDigestSize bytes, anything else (a hash in another format) as text
+bool add_digest_bind(sqlite3_stmt *stmt, int index, const std::string& digest) {
+  unsigned char bytes[kDigestSize];
+  if(!digest_to_bytes(digest, bytes)) {
+    return add_text_bind(stmt, index, digest, "digest");
+  }
+  if(sqlite3_bind_blob(stmt, index, bytes, kDigestSize, SQLITE_TRANSIENT) != SQLITE_OK) {
+    LOG(kLogErr) << "Unable to bind @index=" << index << " field_name=digest";
     return(false);
   }
   return(true);
 }
 
+// the hex digest from a column written by add_digest_bind
+std::string column_digest(sqlite3_stmt *stmt, int column) {
+  if(sqlite3_column_type(stmt, column) == SQLITE_BLOB && sqlite3_column_bytes(stmt, column) == kDigestSize) {
+    return digest_to_hex((const unsigned char*)sqlite3_column_blob(stmt, column));
+  }
+  const unsigned char *text = sqlite3_column_text(stmt, column);
+  return text == NULL ? "" : (const char*)text;
+}
+
 bool add_int_bind(sqlite3_stmt *stmt, int index, int value, const char *field_name) {
   int rc = 0;
   rc = sqlite3_bind_int(stmt, index, value);
   if(rc != SQLITE_OK) {
-    std::clog << kLogErr << "Unable to bind @index=" << index << " field_name=" << field_name << std::endl;
+    LOG(kLogErr) << "Unable to bind @index=" << index << " field_name=" << field_name;
     return(false);
   }
   return(true);
@@ -105,7 +402,7 @@ bool add_int_bind(sqlite3_stmt *stmt, int index, int value, const char *field_na
 bool run_stmt(sqlite3_stmt *stmt, int expected_rc) {
   int rc = 0;
   rc = sqlite3_step(stmt);
-  std::clog << kLogInfo << "Response from sqlite=" << rc << " expected=" << expected_rc << std::endl;
+  LOG(kLogDebug) << "Response from sqlite=" << rc << " expected=" << expected_rc;
   if(rc == expected_rc) {
     return true;
   } else {
@@ -113,202 +410,432 @@ bool run_stmt(sqlite3_stmt *stmt, int expected_rc) {
   }
 }
 
-bool save_user_in_cache_w_salt(sqlite3 **db, std::string username, std::string password, std::string salt) {
+// binds ?2 to ?8 of the add and update statements, the digest, salt, timestamp, account fields and keep_until, a
+// keep_for of 0 means the caller does not know how long the row is used
+bool add_record_binds(sqlite3_stmt *stmt, const CacheRecord& record, int ts, int keep_for) {
+  bool known = record.account_known;
+  return add_digest_bind(stmt, 2, record.password) &&
+    (record.salted ? add_text_bind(stmt, 3, record.salt, "salt") : sqlite3_bind_null(stmt, 3) == SQLITE_OK) &&
+    add_int_bind(stmt, 4, ts, "timestamp") &&
+    (known ? add_int_bind(stmt, 5, record.enabled ? 1 : 0, "enabled") : sqlite3_bind_null(stmt, 5) == SQLITE_OK) &&
+    (known ? sqlite3_bind_int64(stmt, 6, record.expires_at) == SQLITE_OK : sqlite3_bind_null(stmt, 6) == SQLITE_OK) &&
+    (known ? add_text_bind(stmt, 7, record.groups, "user_groups") : sqlite3_bind_null(stmt, 7) == SQLITE_OK) &&
+    (keep_for > 0 ? add_int_bind(stmt, 8, ts + keep_for, "keep_until") : sqlite3_bind_null(stmt, 8) == SQLITE_OK);
+}
+
+bool save_user_in_cache(CacheDb *cdb, const std::string& username, const CacheRecord& record, int keep_for) {
   bool success = true;
+  sqlite3_stmt *stmt = cdb->add_user;
+  StmtReset reset(stmt);
 
-  // prepare SQL statement
-  sqlite3_stmt *stmt;
-  if(prep_stmt(db, &stmt, ADD_USER_W_SALT_TO_CACHE_SQL)) {
-    std::clog << kLogInfo << "Statement prepared" << std::endl;
-    // add binds
-    if(!add_text_bind(stmt, 1, username, "username")) {
-      success = false;
-    }
-    if(!add_text_bind(stmt, 2, password, "password")) {
-      success = false;
-    }
-    if(!add_text_bind(stmt, 3, salt, "salt")) {
-      success = false;
-    }
-    int current_ts = (int)time(NULL);
-    if(!add_int_bind(stmt, 4, current_ts, "timestamp")) {
-      success = false;
-    }
-    std::clog << kLogInfo << "Binds added" << std::endl;
-    // run statement
-    if(success) {
-      if(run_stmt(stmt, SQLITE_DONE)) {
-        success = true;
-      } else {
-        success = false;
-      }
-    } 
-  } else {
-    std::clog << kLogErr << "Unable to prepare statement" << std::endl;
+  // add binds
+  if(!add_text_bind(stmt, 1, username, "username") || !add_record_binds(stmt, record, (int)time(NULL), keep_for)) {
+    success = false;
+  }
+  LOG(kLogDebug) << "Binds added";
+  // run statement
+  if(success) {
+    success = run_stmt(stmt, SQLITE_DONE);
   }
-  // free the statement as we finished with it
-  sqlite3_finalize(stmt);
   return success;
 }
 
-bool save_user_in_cache(sqlite3 **db, std::string username, std::string password) {
+bool lookup_user_in_cache(CacheDb *cdb, const std::string& username, int sess_dur, CacheRecord& record) {
   bool success = true;
+  sqlite3_stmt *stmt = cdb->lookup_user;
+  StmtReset reset(stmt);
 
-  // prepare SQL statement
-  sqlite3_stmt *stmt;
-  if(prep_stmt(db, &stmt, ADD_USER_TO_CACHE_SQL)) {
-    std::clog << kLogInfo << "Statement prepared" << std::endl;
-    // add binds
-    if(!add_text_bind(stmt, 1, username, "username")) {
+  // add binds
+  if(!add_text_bind(stmt, 1, username, "username")) {
+    success = false;
+  }
+  int current_ts = (int)time(NULL);
+  if(!add_int_bind(stmt, 2, current_ts - sess_dur, "timestamp")) {
+    success = false;
+  }
+  // run statement
+  if(success) {
+    if(run_stmt(stmt, SQLITE_ROW)) {
+      record.password = column_digest(stmt, 0);
+      record.salted = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+      record.salt = record.salted ? (const char*)sqlite3_column_text(stmt, 1) : "";
+      record.timestamp = sqlite3_column_int(stmt, 2);
+      record.account_known = sqlite3_column_type(stmt, 3) != SQLITE_NULL;
+      record.enabled = sqlite3_column_int(stmt, 3) != 0 || !record.account_known;
+      record.expires_at = sqlite3_column_int64(stmt, 4);
+      const unsigned char *groups = sqlite3_column_text(stmt, 5);
+      record.groups = groups == NULL ? "" : (const char*)groups;
+      LOG(kLogDebug) << "Got a row, salted=" << record.salted << ", account_known=" << record.account_known;
+    } else {
       success = false;
     }
-    if(!add_text_bind(stmt, 2, password, "password")) {
-      success = false;
+  }
+  return success;
+}
+
+// runs a statement whose binds are (text..., int) or, when keep_for is given, (text..., int, int), used by the
+// negative cache helpers
+bool run_negative_stmt(sqlite3_stmt *stmt, const std::string& username, const std::string *attempt, int ts, int expected_rc, int keep_for = 0) {
+  StmtReset reset(stmt);
+  int index = 1;
+  if(!add_text_bind(stmt, index++, username, "username")) {
+    return false;
+  }
+  if(attempt != NULL && !add_text_bind(stmt, index++, *attempt, "attempt")) {
+    return false;
+  }
+  if(!add_int_bind(stmt, index, ts, "timestamp")) {
+    return false;
+  }
+  if(keep_for > 0 && !add_int_bind(stmt, index + 1, ts + keep_for, "keep_until")) {
+    return false;
+  }
+  return run_stmt(stmt, expected_rc);
+}
+
+// runs a statement whose only bind is the username
+bool run_username_stmt(sqlite3_stmt *stmt, const std::string& username) {
+  StmtReset reset(stmt);
+  return add_text_bind(stmt, 1, username, "username") && run_stmt(stmt, SQLITE_DONE);
+}
+
+// runs a one-off statement with up to two int binds, returns the number of rows changed or -1 on error
+int run_sweep_stmt(sqlite3 *db, const char *sql, int first, int second = 0) {
+  sqlite3_stmt *stmt = NULL;
+  if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    LOG(kLogErr) << "Failed to prepare sweep statement, error message=" << sqlite3_errmsg(db);
+    return -1;
+  }
+  int changed = -1;
+  if(sqlite3_bind_int(stmt, 1, first) == SQLITE_OK && (sqlite3_bind_parameter_count(stmt) < 2 || sqlite3_bind_int(stmt, 2, second) == SQLITE_OK) &&
+     sqlite3_step(stmt) == SQLITE_DONE) {
+    changed = sqlite3_changes(db);
+  }
+  sqlite3_finalize(stmt);
+  return changed;
+}
+
+// deletes expired rows and evicts the oldest users beyond cache_max_rows
+// runs at most once per cache_sweep_interval across every process sharing the file, the caller holds cdb->lock
+void sweep_if_due(CacheDb *cdb, const Options& opts) {
+  time_t now = time(NULL);
+  if(opts.cache_sweep_interval <= 0 || now < cdb->next_sweep_check) {
+    return;
+  }
+  cdb->next_sweep_check = now + opts.cache_sweep_interval;
+
+  char *zErrMsg = 0;
+  if(sqlite3_exec(cdb->conn, "BEGIN IMMEDIATE;", NULL, 0, &zErrMsg) != SQLITE_OK) {
+    LOG(kLogWarning) << "Could not start sweep: " << zErrMsg;
+    sqlite3_free(zErrMsg);
+    return;
+  }
+  bool claimed = run_sweep_stmt(cdb->conn, CLAIM_SWEEP_SQL, (int)now, (int)now - opts.cache_sweep_interval) == 1;
+  if(claimed) {
+    int evicted = 0;
+    int expired = run_sweep_stmt(cdb->conn, SWEEP_USERS_SQL, (int)now);
+    run_sweep_stmt(cdb->conn, SWEEP_UNKNOWN_USERS_SQL, (int)now);
+    run_sweep_stmt(cdb->conn, SWEEP_FAILED_ATTEMPTS_SQL, (int)now);
+    if(opts.cache_max_rows > 0) {
+      // the limit is for the realm, so each shard keeps its share
+      evicted = run_sweep_stmt(cdb->conn, EVICT_USERS_SQL, (opts.cache_max_rows + opts.cache_shards - 1) / opts.cache_shards);
     }
-    int current_ts = (int)time(NULL);
-    if(!add_int_bind(stmt, 3, current_ts, "timestamp")) {
-      success = false;
+    LOG(kLogInfo) << "Swept cache, expired=" << expired << " evicted=" << evicted;
+  }
+  if(sqlite3_exec(cdb->conn, "COMMIT;", NULL, 0, &zErrMsg) != SQLITE_OK) {
+    LOG(kLogWarning) << "Could not finish sweep: " << zErrMsg;
+    sqlite3_free(zErrMsg);
+    sqlite3_exec(cdb->conn, "ROLLBACK;", NULL, 0, NULL);
+  }
+}
+
+int Cache::shard_for(const std::string& username) {
+  // spread on the username only, the realm is the same for every shard
+  return opts.cache_shards <= 1 ? 0 : (int)(key_hash("", username) % opts.cache_shards);
+}
+
+CacheDb *Cache::open_shard(int shard) {
+  if(dbs[shard] != NULL) {
+    return dbs[shard];
+  }
+  StageTimer timer(STAGE_CACHE_OPEN);
+  if(!check_and_init(directory, realm, shard, opts, &dbs[shard])) {
+    LOG(kLogWarning) << "Could not open cache, look at previous log messages for hints";
+    dbs[shard] = NULL;
+    return NULL;
+  }
+  return dbs[shard];
+}
+
+CacheDb *Cache::open(const std::string& username) {
+  return open_shard(shard_for(username));
+}
+
+void Cache::share(const std::string& username, const CacheRecord& record) {
+  if(!shm.put(realm, username, record)) {
+    shm.remove(realm, username);
+  }
+}
+
+int Cache::keep_for() {
+  // 0 for the tools, which do not know how long entries live
+  return session_duration > 0 ? session_duration + opts.stale_if_error : 0;
+}
+
+std::string cache_scope(const std::string& directory, const Options& opts) {
+  return directory + '\0' + opts.table + '\0' + opts.region;
+}
+
+bool Cache::save_record(std::string username, const CacheRecord& record) {
+  bool success = false;
+  CacheRecord saved = record;
+  saved.timestamp = (int)time(NULL);
+  if(opts.cache_write_behind && queue_cache_write(directory, realm, session_duration, opts, username, saved)) {
+    // sqlite is written in the background, the shared memory cache straight away so other processes see it
+    local.put(realm, username, saved);
+    share(username, saved);
+    return true;
+  }
+  CacheDb *db = open(username);
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = save_user_in_cache(db, username, saved, keep_for());
+    sweep_if_due(db, opts);
+  }
+  local.put(realm, username, saved);
+  share(username, saved);
+  return success;
+}
+
+bool Cache::save_in_cache_w_salt(std::string username, std::string password, std::string salt) {
+  CacheRecord record = { password, salt, true, 0, false, true, 0, "" };
+  return save_record(username, record);
+}
+
+bool Cache::save_in_cache(std::string username, std::string password) {
+  CacheRecord record = { password, "", false, 0, false, true, 0, "" };
+  return save_record(username, record);
+}
+
+bool Cache::lookup(std::string username, CacheRecord& record) {
+  bool success = false;
+  int max_age = session_duration + opts.stale_if_error;
+  if(local.get(realm, username, record) && record.timestamp > (int)time(NULL) - max_age) {
+    LOG(kLogInfo) << "User found in process cache";
+    return true;
+  }
+  if(shm.get(realm, username, record) && record.timestamp > (int)time(NULL) - max_age) {
+    // the shared memory entry is written alongside the sqlite row so it is just as current
+    LOG(kLogInfo) << "User found in shared memory cache";
+    local.put(realm, username, record);
+    return true;
+  }
+  if(opts.cache_write_behind && find_queued_write(scope, realm, username, record) && record.timestamp > (int)time(NULL) - max_age) {
+    LOG(kLogInfo) << "User found in cache write queue";
+    local.put(realm, username, record);
+    return true;
+  }
+  CacheDb *db = open(username);
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = lookup_user_in_cache(db, username, max_age, record);
+  }
+  if(success) {
+    // so the next process finds it without touching sqlite
+    local.put(realm, username, record);
+    shm.put(realm, username, record);
+  }
+  return success;
+}
+
+bool Cache::remove_user(std::string username) {
+  bool success = false;
+  if(opts.cache_write_behind) {
+    forget_queued_write(scope, realm, username);
+  }
+  CacheDb *db = open(username);
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = run_username_stmt(db->remove_user, username);
+  }
+  // after sqlite, so a lookup racing us cannot copy the row back into them
+  local.remove(realm, username);
+  shm.remove(realm, username);
+  return success;
+}
+
+bool Cache::update_user(std::string username, const CacheRecord& record) {
+  bool success = false;
+  if(opts.cache_write_behind) {
+    // a queued save would overwrite the update with the old hash
+    forget_queued_write(scope, realm, username);
+  }
+  CacheDb *db = open(username);
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    {
+      sqlite3_stmt *stmt = db->update_user;
+      StmtReset reset(stmt);
+      success = add_text_bind(stmt, 1, username, "username") &&
+        add_record_binds(stmt, record, (int)time(NULL), keep_for()) &&
+        run_stmt(stmt, SQLITE_DONE);
     }
-    std::clog << kLogInfo << "Binds added" << std::endl;
-    // run statement
-    if(success) {
-      if(run_stmt(stmt, SQLITE_DONE)) {
-        success = true;
-      } else {
-        success = false;
-      }
-    } 
+    // the user exists now and earlier rejections may no longer hold
+    run_username_stmt(db->forget_unknown_user, username);
+    run_username_stmt(db->forget_failed_attempts, username);
+  }
+  // read again from the shared caches on the next lookup
+  local.remove(realm, username);
+  CacheRecord current;
+  if(shm.get(realm, username, current)) {
+    CacheRecord updated = record;
+    updated.timestamp = (int)time(NULL);
+    share(username, updated);
   } else {
-    std::clog << kLogErr << "Unable to prepare statement" << std::endl;
+    // not found may also mean another writer is putting the old hash there right now
+    shm.remove(realm, username);
   }
-  // free the statement as we finished with it
-  sqlite3_finalize(stmt);
   return success;
 }
 
-bool get_user_salt(sqlite3 **db, std::string username, int sess_dur, std::string& salt) {
+bool Cache::clear() {
   bool success = true;
-  // prepare SQL statement
-  sqlite3_stmt *stmt;
-  if(prep_stmt(db, &stmt, GET_SALT_SQL)) {
-    std::clog << kLogInfo << "Statement prepared" << std::endl;
-    // add binds
-    if(!add_text_bind(stmt, 1, username, "username")) {
-      success = false;
+  for(int shard = 0; shard < opts.cache_shards; shard++) {
+    if(access(cache_db_path(directory, realm, shard, opts.cache_shards).c_str(), F_OK) != 0) {
+      continue;
     }
-    int current_ts = (int)time(NULL);
-    if(!add_int_bind(stmt, 2, current_ts - sess_dur, "timestamp")) {
+    CacheDb *db = open_shard(shard);
+    if(db == NULL) {
       success = false;
+      continue;
     }
-    std::clog << kLogInfo << "Binds added" << std::endl;
-    // run statement
-    if(success) {
-      if(run_stmt(stmt, SQLITE_ROW)) {
-        std::clog << kLogInfo << "Got a row" << std::endl;
-        if(sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
-          std::clog << kLogInfo << "Salt is null" << std::endl;
-          success = false;
-        } else {
-          std::clog << kLogInfo << "Salt is not null" << std::endl;
-          success = true;
-          // need to get the salt value
-          salt = (char*)sqlite3_column_text(stmt, 0);
-        }
-        
-      } else {
-        success = false;
-      }
-    } 
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = exec_sql(db->conn, CLEAR_SQL, "clear cache") && success;
   }
-  // free the statement as we finished with it
-  sqlite3_finalize(stmt);
+  // after sqlite, as for remove_user
+  shm.remove_realm(realm);
   return success;
 }
 
-bool check_for_user_in_cache(sqlite3 **db, std::string username, std::string password, int sess_dur) {
-  bool success = true;
-  // prepare SQL statement
-  sqlite3_stmt *stmt;
-  if(prep_stmt(db, &stmt, CHECK_FOR_USER_SQL)) {
-    std::clog << kLogInfo << "Statement prepared" << std::endl;
-    // add binds
-    if(!add_text_bind(stmt, 1, username, "username")) {
-      success = false;
-    }
-    if(!add_text_bind(stmt, 2, password, "password")) {
-      success = false;
+bool Cache::exists() {
+  for(int shard = 0; shard < opts.cache_shards; shard++) {
+    if(access(cache_db_path(directory, realm, shard, opts.cache_shards).c_str(), F_OK) == 0) {
+      return true;
     }
-    int current_ts = (int)time(NULL);
-    if(!add_int_bind(stmt, 3, current_ts - sess_dur, "timestamp")) {
-      success = false;
-    }
-    std::clog << kLogInfo << "Binds added" << std::endl;
-    // run statement
-    if(success) {
-      if(run_stmt(stmt, SQLITE_ROW)) {
-        success = true;
-      } else {
-        success = false;
-      }
-    } 
   }
-  // free the statement as we finished with it
-  sqlite3_finalize(stmt);
-  return success;
+  return false;
 }
 
-bool Cache::save_in_cache_w_salt(std::string username, std::string password, std::string salt) {
+bool Cache::check_cache(std::string username, std::string password) {
+  CacheRecord record;
+  return lookup(username, record) && record.timestamp > (int)time(NULL) - session_duration && record.password == password;
+}
+
+bool Cache::get_user_from_cache(std::string username, std::string& salt) {
+  CacheRecord record;
+  if(lookup(username, record) && record.timestamp > (int)time(NULL) - session_duration && record.salted) {
+    salt = record.salt;
+    return true;
+  }
+  return false;
+}
+
+bool Cache::is_unknown_user(std::string username) {
   bool success = false;
-  sqlite3 *db;
-  if(check_and_init(directory, realm, &db)) {
-    std::clog << kLogInfo << "Cache open" << std::endl;
-    success = save_user_in_cache_w_salt(&db, username, password, salt);
-    sqlite3_close(db);
-  } else {
-    std::clog << kLogWarning << "Could not open cache, look at previous log messages for hints" << std::endl;
-    success = false;
+  CacheDb *db = opts.negative_user_ttl > 0 ? open(username) : NULL;
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = run_negative_stmt(db->check_unknown_user, username, NULL, (int)time(NULL) - opts.negative_user_ttl, SQLITE_ROW);
   }
   return success;
 }
 
-bool Cache::save_in_cache(std::string username, std::string password) {
+bool Cache::save_unknown_user(std::string username) {
   bool success = false;
-  sqlite3 *db;
-  if(check_and_init(directory, realm, &db)) {
-    std::clog << kLogInfo << "Cache open" << std::endl;
-    success = save_user_in_cache(&db, username, password);
-    sqlite3_close(db);
-  } else {
-    std::clog << kLogWarning << "Could not open cache, look at previous log messages for hints" << std::endl;
-    success = false;
+  CacheDb *db = opts.negative_user_ttl > 0 ? open(username) : NULL;
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = run_negative_stmt(db->add_unknown_user, username, NULL, (int)time(NULL), SQLITE_DONE, opts.negative_user_ttl);
+    sweep_if_due(db, opts);
   }
   return success;
 }
 
-bool Cache::check_cache(std::string username, std::string password) {
+bool Cache::is_failed_attempt(std::string username, std::string attempt) {
   bool success = false;
-  sqlite3 *db;
-  if(check_and_init(directory, realm, &db)) {
-    std::clog << kLogInfo << "Cache open" << std::endl;
-    // check if user is in cache
-    success = check_for_user_in_cache(&db, username, password, session_duration);
-    sqlite3_close(db);
-  } else {
-    std::clog << kLogWarning << "Could not open cache, look at previous log messages for hints" << std::endl;
-    success = false;
+  CacheDb *db = opts.negative_password_ttl > 0 ? open(username) : NULL;
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = run_negative_stmt(db->check_failed_attempt, username, &attempt, (int)time(NULL) - opts.negative_password_ttl, SQLITE_ROW);
   }
   return success;
 }
 
-bool Cache::get_user_from_cache(std::string username, std::string& salt) {
+bool Cache::save_failed_attempt(std::string username, std::string attempt) {
   bool success = false;
-  sqlite3 *db;
-  if(check_and_init(directory, realm, &db)) {
-    success = get_user_salt(&db, username, session_duration, salt);
-    sqlite3_close(db);
-  } else {
-    std::clog << kLogWarning << "Could not open cache, look at previous log messages for hints" << std::endl;
+  CacheDb *db = opts.negative_password_ttl > 0 ? open(username) : NULL;
+  if(db != NULL) {
+    std::lock_guard<std::mutex> lock(db->lock);
+    success = run_negative_stmt(db->add_failed_attempt, username, &attempt, (int)time(NULL), SQLITE_DONE, opts.negative_password_ttl);
+    sweep_if_due(db, opts);
+  }
+  return success;
+}
+
+// saves records into one shard in a single transaction
+bool save_shard(CacheDb *db, const std::vector<const std::pair<std::string, CacheRecord>*>& records, int keep_for) {
+  char *zErrMsg = 0;
+  if(sqlite3_exec(db->conn, "BEGIN IMMEDIATE;", NULL, 0, &zErrMsg) != SQLITE_OK) {
+    LOG(kLogErr) << "Could not start transaction: " << zErrMsg;
+    sqlite3_free(zErrMsg);
+    return false;
+  }
+  bool success = true;
+  for(const auto *entry : records) {
+    success = save_user_in_cache(db, entry->first, entry->second, keep_for);
+    if(!success) {
+      break;
+    }
+  }
+  if(sqlite3_exec(db->conn, success ? "COMMIT;" : "ROLLBACK;", NULL, 0, &zErrMsg) != SQLITE_OK) {
+    LOG(kLogErr) << "Could not end transaction: " << zErrMsg;
+    sqlite3_free(zErrMsg);
     success = false;
   }
   return success;
+}
+
+bool Cache::save_many(const std::vector<std::pair<std::string, CacheRecord>>& records) {
+  std::vector<std::vector<const std::pair<std::string, CacheRecord>*>> by_shard(opts.cache_shards);
+  for(const auto& entry : records) {
+    by_shard[shard_for(entry.first)].push_back(&entry);
+  }
+  bool success = true;
+  int current_ts = (int)time(NULL);
+  for(int shard = 0; shard < opts.cache_shards; shard++) {
+    if(by_shard[shard].empty()) {
+      continue;
+    }
+    CacheDb *db = open_shard(shard);
+    if(db == NULL) {
+      success = false;
+      continue;
+    }
+    bool saved = false;
+    {
+      std::lock_guard<std::mutex> lock(db->lock);
+      saved = save_shard(db, by_shard[shard], keep_for());
+      sweep_if_due(db, opts);
+    }
+    if(saved) {
+      for(const auto *entry : by_shard[shard]) {
+        CacheRecord record = entry->second;
+        record.timestamp = current_ts;
+        local.put(realm, entry->first, record);
+        share(entry->first, record);
+      }
+    }
+    success = success && saved;
+  }
+  return success;
 }
\ No newline at end of file
@@ -0,0 +1,16 @@
+#include "CallContext.h"
+#include "Log.h"
+#include "Stats.h"
+
+CallContext::CallContext(const Options& opts) {
+  // saved so contexts can nest
+  saved_log_level = log_call_level;
+  saved_stats = stats_call_enabled;
+  log_call_level = opts.log_level;
+  stats_call_enabled = opts.stats != 0;
+}
+
+CallContext::~CallContext() {
+  log_call_level = saved_log_level;
+  stats_call_enabled = saved_stats;
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#include <iostream>
+#include <time.h>
+
+#include "CredentialBackend.h"
+#include "DynamoBackend.h"
+#include "HedgedBackend.h"
+#include "SnapshotBackend.h"
+
+void MemoryBackend::add(const std::string& realm, const std::string& username, const CacheRecord& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  users[realm + '\n' + username] = record;
+}
+
+int MemoryBackend::fetch(const std::string& realm, const std::string& username, CacheRecord& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = users.find(realm + '\n' + username);
+  if(found == users.end()) {
+    return FETCH_NOT_FOUND;
+  }
+  record = found->second;
+  record.timestamp = (int)time(NULL);
+  return FETCH_FOUND;
+}
+
+std::shared_ptr<CredentialBackend> make_backend(const std::string& region, const std::string& table, const Options& opts) {
+  std::shared_ptr<CredentialBackend> dynamo;
+  if(opts.regions.size() > 1) {
+    std::vector<std::shared_ptr<CredentialBackend>> replicas;
+    for(const std::string& r : opts.regions) {
+      replicas.push_back(std::make_shared<DynamoBackend>(r, table, opts.backend_timeout_ms, opts.endpoint_for(r)));
+    }
+    dynamo = std::make_shared<HedgedBackend>(opts.regions, replicas, opts.hedge_percentile, opts.hedge_delay_ms);
+  } else {
+    std::string only = opts.regions.empty() ? region : opts.regions[0];
+    dynamo = std::make_shared<DynamoBackend>(only, table, opts.backend_timeout_ms, opts.endpoint_for(only));
+  }
+  if(opts.snapshot_path.empty()) {
+    return dynamo;
+  }
+  return std::make_shared<SnapshotBackend>(opts.snapshot_path, dynamo);
+}
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <iostream>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "Digest.h"
+#include "Log.h"
+
+// the digest algorithm, looked up once
+static const EVP_MD *sha3_256() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // an explicit fetch saves the provider lookup EVP_sha3_256() would do on every init
+  static const EVP_MD *md = EVP_MD_fetch(NULL, "SHA3-256", NULL);
+  return md;
+#else
+  return EVP_sha3_256();
+#endif
+}
+
+// a digest context per thread which is reset and reused for every hash
+struct DigestContext {
+  EVP_MD_CTX *mdctx;
+
+  DigestContext() : mdctx(EVP_MD_CTX_new()) {}
+  ~DigestContext() { EVP_MD_CTX_free(mdctx); }
+};
+
+static thread_local DigestContext digest_context;
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// based on this code https://stackoverflow.com/questions/2262386/generate-sha256-with-openssl-and-c
+// and this code https://wiki.openssl.org/index.php/EVP_Message_Digests
+bool hash_password(const std::string& prefix, const std::string& password, HexDigest& hashed) {
+  EVP_MD_CTX *mdctx = digest_context.mdctx;
+  const EVP_MD *md = sha3_256();
+  if(mdctx == NULL || md == NULL) {
+    // could not get message digest context
+    LOG(kLogErr) << "Could not get message digest context";
+    return false;
+  }
+  if(!EVP_DigestInit_ex(mdctx, md, NULL)) {
+    // could not init digest algorithm
+    LOG(kLogErr) << "Unable to init digest algorithm";
+    return false;
+  }
+  if(!EVP_DigestUpdate(mdctx, prefix.data(), prefix.length()) || !EVP_DigestUpdate(mdctx, password.data(), password.length())) {
+    // could not add message to digest
+    LOG(kLogErr) << "Unable to add password to digest";
+    return false;
+  }
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  unsigned int lengthOfHash = 0;
+  if(!EVP_DigestFinal_ex(mdctx, hash, &lengthOfHash) || lengthOfHash * 2 + 1 != kDigestHexSize) {
+    LOG(kLogErr) << "Unable to finalise digest";
+    return false;
+  }
+  for(unsigned int i = 0; i < lengthOfHash; ++i) {
+    hashed.hex[i * 2] = HEX_DIGITS[hash[i] >> 4];
+    hashed.hex[i * 2 + 1] = HEX_DIGITS[hash[i] & 0x0f];
+  }
+  hashed.hex[lengthOfHash * 2] = '\0';
+  return true;
+}
+
+static int hex_value(char c) {
+  if(c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if(c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+bool digest_to_bytes(const std::string& hex, unsigned char *bytes) {
+  if(hex.length() != (size_t)kDigestSize * 2) {
+    return false;
+  }
+  for(int i = 0; i < kDigestSize; i++) {
+    int high = hex_value(hex[i * 2]);
+    int low = hex_value(hex[i * 2 + 1]);
+    if(high < 0 || low < 0) {
+      return false;
+    }
+    bytes[i] = (unsigned char)(high << 4 | low);
+  }
+  return true;
+}
+
+std::string digest_to_hex(const unsigned char *bytes) {
+  std::string hex(kDigestSize * 2, '0');
+  for(int i = 0; i < kDigestSize; i++) {
+    hex[i * 2] = HEX_DIGITS[bytes[i] >> 4];
+    hex[i * 2 + 1] = HEX_DIGITS[bytes[i] & 0x0f];
+  }
+  return hex;
+}
+
+bool digest_matches(const std::string& stored, const HexDigest& computed) {
+  // the length is not a secret, only the contents are compared in constant time
+  if(computed.empty() || stored.length() != (size_t)(kDigestHexSize - 1)) {
+    return false;
+  }
+  return CRYPTO_memcmp(stored.data(), computed.hex, kDigestHexSize - 1) == 0;
+}
\ No newline at end of file
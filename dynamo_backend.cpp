@@ -0,0 +1,90 @@
+#include <iostream>
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/Outcome.h>
+#include <aws/dynamodb/DynamoDBClient.h>
+#include <aws/dynamodb/model/AttributeValue.h>
+#include <aws/dynamodb/model/GetItemRequest.h>
+#include <aws/dynamodb/model/QueryRequest.h>
+
+#include "DynamoBackend.h"
+#include "DynamoClients.h"
+#include "Log.h"
+
+DynamoBackend::DynamoBackend(std::string p_region, std::string p_table, int p_timeout_ms, std::string p_endpoint) {
+  region = p_region;
+  table = p_table;
+  timeout_ms = p_timeout_ms;
+  endpoint = p_endpoint;
+}
+
+int DynamoBackend::fetch(const std::string& realm, const std::string& username, CacheRecord& record) {
+  // get request ready, the client (and its connections) are reused across calls
+  std::shared_ptr<Aws::DynamoDB::DynamoDBClient> dynamoClient = get_dynamo_client(region, timeout_ms, endpoint);
+  Aws::DynamoDB::Model::GetItemRequest req;
+
+  // set table
+  req.SetTableName(Aws::String(table.c_str()));
+  // add hash key (auth realm)
+  Aws::DynamoDB::Model::AttributeValue hashKey;
+  hashKey.SetS(Aws::String(realm.c_str()));
+  req.AddKey("realm", hashKey);
+  // add sort key (username)
+  Aws::DynamoDB::Model::AttributeValue sortKey;
+  sortKey.SetS(Aws::String(username.c_str()));
+  req.AddKey("user", sortKey);
+
+  // fire request to API
+  LOG(kLogInfo) << "Calling DynamoDB API in region=" << region;
+  const Aws::DynamoDB::Model::GetItemOutcome& result = dynamoClient->GetItem(req);
+  LOG(kLogDebug) << "Back from call to API";
+  if(!result.IsSuccess()) {
+    LOG(kLogErr) << "Failed to query table=" << table << ", error message=" << result.GetError().GetMessage();
+    return FETCH_ERROR;
+  }
+  LOG(kLogDebug) << "Result is a success from API";
+  // got a response
+  const Aws::Map<Aws::String, Aws::DynamoDB::Model::AttributeValue>& item = result.GetResult().GetItem();
+  if(item.size() <= 1) {
+    // got no items, user does not exist
+    LOG(kLogInfo) << "No user found in realm=" << realm << ", with username=" << username;
+    return FETCH_NOT_FOUND;
+  }
+  // got an item, check to see if password is present
+  if(!item_to_record(item, record)) {
+    LOG(kLogInfo) << "No item with password field found";
+    return FETCH_NOT_FOUND;
+  }
+  LOG(kLogDebug) << "Password from record = " << record.password;
+  return FETCH_FOUND;
+}
+
+bool query_realm(Aws::DynamoDB::DynamoDBClient& client, const std::string& table, const std::string& realm,
+                 std::vector<std::pair<std::string, CacheRecord>>& records) {
+  Aws::Map<Aws::String, Aws::DynamoDB::Model::AttributeValue> start_key;
+  do {
+    Aws::DynamoDB::Model::QueryRequest req;
+    req.SetTableName(Aws::String(table.c_str()));
+    req.SetKeyConditionExpression("realm = :realm");
+    req.AddExpressionAttributeValues(":realm", Aws::DynamoDB::Model::AttributeValue(Aws::String(realm.c_str())));
+    project_user_attributes(req, "#user");
+    if(!start_key.empty()) {
+      req.SetExclusiveStartKey(start_key);
+    }
+    const Aws::DynamoDB::Model::QueryOutcome& result = client.Query(req);
+    if(!result.IsSuccess()) {
+      LOG(kLogErr) << "Failed to query table=" << table << ", error message=" << result.GetError().GetMessage();
+      return false;
+    }
+    for(const auto& item : result.GetResult().GetItems()) {
+      auto user = item.find("user");
+      CacheRecord record;
+      if(user != item.end() && item_to_record(item, record)) {
+        Aws::String username = user->second.GetS();
+        records.push_back(std::make_pair(std::string(username.c_str(), username.size()), record));
+      }
+    }
+    start_key = result.GetResult().GetLastEvaluatedKey();
+  } while(!start_key.empty());
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <aws/core/Aws.h>
+#include <aws/dynamodb/DynamoDBClient.h>
+
+#include "DynamoClients.h"
+#include "Log.h"
+
+typedef std::shared_ptr<Aws::DynamoDB::DynamoDBClient> ClientPtr;
+
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::mutex sdk_mutex;
+static bool sdk_initialised = false;
+// set in a forked child, whose SDK state came from the parent and must not be shut down
+static bool sdk_inherited = false;
+static bool fork_handlers_registered = false;
+static Aws::SDKOptions& sdk_options = *new Aws::SDKOptions();
+static std::map<std::string, ClientPtr>& clients = *new std::map<std::string, ClientPtr>();
+
+// sdk_mutex is held across fork so the child never inherits it locked by a thread which does not exist there
+static void before_fork() {
+  sdk_mutex.lock();
+}
+
+static void after_fork_in_parent() {
+  sdk_mutex.unlock();
+}
+
+// only the forking thread carries on in the child, the SDK's threads and the clients relying on them are gone, so
+// the next call initialises the SDK again
+static void after_fork_in_child() {
+  if(sdk_initialised) {
+    sdk_inherited = true;
+    sdk_initialised = false;
+  }
+  sdk_mutex.unlock();
+}
+
+ClientPtr get_dynamo_client(const std::string& region, int timeout_ms, const std::string& endpoint) {
+  std::lock_guard<std::mutex> lock(sdk_mutex);
+
+  if(!sdk_initialised) {
+    if(sdk_inherited && !clients.empty()) {
+      // the pooled connections belong to the parent so they must not be used or cleaned up here (that would shut
+      // down the parent's TLS sessions), just let them go
+      LOG(kLogInfo) << "Process forked, discarding DynamoDB clients inherited from parent";
+      for(auto& entry : clients) {
+        new ClientPtr(entry.second);
+      }
+      clients.clear();
+    }
+    // ShutdownAPI is not called for the inherited state, it would wait for the parent's threads
+    LOG(kLogInfo) << "Init for AWS API";
+    Aws::InitAPI(sdk_options);
+    sdk_initialised = true;
+    if(!fork_handlers_registered) {
+      fork_handlers_registered = pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child) == 0;
+    }
+  }
+
+  std::string key = region + "/" + std::to_string(timeout_ms) + "/" + endpoint;
+  auto found = clients.find(key);
+  if(found != clients.end()) {
+    return found->second;
+  }
+
+  LOG(kLogInfo) << "Creating DynamoDB client for region=" << region;
+  Aws::Client::ClientConfiguration clientConfig;
+  clientConfig.region = Aws::String(region.c_str());
+  if(timeout_ms > 0) {
+    clientConfig.connectTimeoutMs = timeout_ms;
+    clientConfig.requestTimeoutMs = timeout_ms;
+  }
+  if(!endpoint.empty()) {
+    LOG(kLogInfo) << "Using endpoint=" << endpoint << " for region=" << region;
+    clientConfig.endpointOverride = Aws::String(endpoint.c_str());
+  }
+  ClientPtr client = Aws::MakeShared<Aws::DynamoDB::DynamoDBClient>("pam-dynamo", clientConfig);
+  clients[key] = client;
+  return client;
+}
+
+// runs when the process exits
+__attribute__((destructor))
+static void shutdown_aws_sdk() {
+  std::lock_guard<std::mutex> lock(sdk_mutex);
+  if(!sdk_initialised || sdk_inherited) {
+    // nothing to do, or part of the SDK state belongs to our parent process
+    return;
+  }
+  clients.clear();
+  Aws::ShutdownAPI(sdk_options);
+  sdk_initialised = false;
+}
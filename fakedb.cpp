@@ -0,0 +1,303 @@
+// pam-dynamo-fakedb, a stand-in for DynamoDB serving synthetic users, for load testing without a real table
+//
+// usage: pam-dynamo-fakedb PORT [--users N] [--salted] [--latency-ms N] [--jitter-ms N] [--error-percent N]
+//
+// it answers GetItem requests sent with the DynamoDB JSON protocol for any table and realm, user0 to user<N-1>
+// exist (see SyntheticUsers.h) and anyone else does not, point the module at it with endpoint_<REGION>=URL
+// every answer is delayed by the latency plus a random part of the jitter, and the given percentage of requests
+// fail with an InternalServerError, the signature on a request is not checked
+
+#include <iostream>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Digest.h"
+#include "Log.h"
+#include "SyntheticUsers.h"
+
+// largest request head or body we will read
+const size_t kMaxRequest = 65536;
+
+static volatile sig_atomic_t running = 1;
+
+void stop(int) {
+  running = 0;
+}
+
+static long user_count = 1000;
+static bool salted = false;
+static int latency_ms = 0;
+static int jitter_ms = 0;
+static int error_percent = 0;
+
+static std::atomic<uint64_t> found_count(0);
+static std::atomic<uint64_t> not_found_count(0);
+static std::atomic<uint64_t> error_count(0);
+static std::atomic<uint64_t> bad_count(0);
+
+// the S value of attribute name within the Key object of a GetItem request, e.g. "user":{"S":"alice"}
+// only the escapes the SDK writes for quotes and backslashes are undone, which is all synthetic names need
+bool key_string(const std::string& body, const std::string& name, std::string& value) {
+  size_t pos = body.find("\"Key\"");
+  if(pos != std::string::npos) {
+    pos = body.find("\"" + name + "\"", pos);
+  }
+  if(pos != std::string::npos) {
+    pos = body.find("\"S\"", pos);
+  }
+  if(pos == std::string::npos) {
+    return false;
+  }
+  pos = body.find_first_not_of(" \t\r\n", pos + 3);
+  if(pos == std::string::npos || body[pos] != ':') {
+    return false;
+  }
+  pos = body.find_first_not_of(" \t\r\n", pos + 1);
+  if(pos == std::string::npos || body[pos] != '"') {
+    return false;
+  }
+  value.clear();
+  for(pos++; pos < body.length() && body[pos] != '"'; pos++) {
+    if(body[pos] == '\\' && pos + 1 < body.length()) {
+      pos++;
+    }
+    value += body[pos];
+  }
+  return pos < body.length();
+}
+
+std::string json_escape(const std::string& in) {
+  std::string out;
+  for(char c : in) {
+    if(c == '"' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+  return out;
+}
+
+// the header value of name in the request head, or an empty string
+std::string header_value(const std::string& head, const char *name) {
+  size_t name_length = strlen(name);
+  size_t pos = head.find("\r\n");
+  while(pos != std::string::npos && pos + 2 < head.length()) {
+    size_t start = pos + 2;
+    size_t end = head.find("\r\n", start);
+    if(end == std::string::npos) {
+      end = head.length();
+    }
+    if(end - start > name_length && head[start + name_length] == ':' && strncasecmp(head.c_str() + start, name, name_length) == 0) {
+      size_t value = head.find_first_not_of(" \t", start + name_length + 1);
+      return value < end ? head.substr(value, end - value) : "";
+    }
+    pos = end;
+  }
+  return "";
+}
+
+// answers a GetItem body, returns the HTTP status and sets the response body
+int get_item(const std::string& body, std::string& response) {
+  std::string realm;
+  std::string username;
+  if(!key_string(body, "realm", realm) || !key_string(body, "user", username)) {
+    bad_count++;
+    response = "{\"__type\":\"com.amazon.coral.validate#ValidationException\",\"message\":\"The provided key element does not match the schema\"}";
+    return 400;
+  }
+  long i = synthetic_index(username);
+  if(i < 0 || i >= user_count) {
+    not_found_count++;
+    response = "{}";
+    return 200;
+  }
+  std::string salt = salted ? synthetic_salt(i) : "";
+  HexDigest hashed;
+  if(!hash_password(salt, synthetic_password(i), hashed)) {
+    error_count++;
+    response = "{\"__type\":\"com.amazonaws.dynamodb.v20120810#InternalServerError\",\"message\":\"Could not hash\"}";
+    return 500;
+  }
+  found_count++;
+  response = "{\"Item\":{\"realm\":{\"S\":\"" + json_escape(realm) + "\"},\"user\":{\"S\":\"" + username +
+             "\"},\"password\":{\"S\":\"" + hashed.str() + "\"}";
+  if(salted) {
+    response += ",\"salt\":{\"S\":\"" + salt + "\"}";
+  }
+  response += "}}";
+  return 200;
+}
+
+bool send_all(int fd, const std::string& data) {
+  size_t sent = 0;
+  while(sent < data.length()) {
+    ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// serves requests on a kept alive connection until the client closes it
+void serve(int fd) {
+  std::mt19937 rng(std::random_device{}());
+  std::string buffer;
+  char chunk[16384];
+  while(true) {
+    // read the request head
+    size_t head_end;
+    while((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if(buffer.length() > kMaxRequest) {
+        close(fd);
+        return;
+      }
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+      if(n <= 0) {
+        close(fd);
+        return;
+      }
+      buffer.append(chunk, n);
+    }
+    std::string head = buffer.substr(0, head_end);
+    buffer.erase(0, head_end + 4);
+    size_t length = strtoul(header_value(head, "Content-Length").c_str(), NULL, 10);
+    if(length > kMaxRequest) {
+      close(fd);
+      return;
+    }
+    if(strcasecmp(header_value(head, "Expect").c_str(), "100-continue") == 0 && !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      close(fd);
+      return;
+    }
+    while(buffer.length() < length) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+      if(n <= 0) {
+        close(fd);
+        return;
+      }
+      buffer.append(chunk, n);
+    }
+    std::string body = buffer.substr(0, length);
+    buffer.erase(0, length);
+
+    int delay_ms = latency_ms + (jitter_ms > 0 ? (int)(rng() % (jitter_ms + 1)) : 0);
+    if(delay_ms > 0) {
+      usleep(delay_ms * 1000);
+    }
+    std::string response;
+    int status;
+    std::string target = header_value(head, "X-Amz-Target");
+    if(target.length() < 8 || target.compare(target.length() - 8, 8, ".GetItem") != 0) {
+      bad_count++;
+      status = 400;
+      response = "{\"__type\":\"com.amazon.coral.service#UnknownOperationException\",\"message\":\"Only GetItem is supported\"}";
+    } else if(error_percent > 0 && (int)(rng() % 100) < error_percent) {
+      error_count++;
+      status = 500;
+      response = "{\"__type\":\"com.amazonaws.dynamodb.v20120810#InternalServerError\",\"message\":\"Injected error\"}";
+    } else {
+      status = get_item(body, response);
+    }
+    bool close_after = strcasecmp(header_value(head, "Connection").c_str(), "close") == 0;
+    std::string reply = "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : status == 400 ? " Bad Request" : " Internal Server Error") +
+                        "\r\nContent-Type: application/x-amz-json-1.0\r\nContent-Length: " + std::to_string(response.length()) +
+                        "\r\nx-amzn-RequestId: pam-dynamo-fakedb\r\n" + (close_after ? "Connection: close\r\n" : "") + "\r\n" + response;
+    if(!send_all(fd, reply) || close_after) {
+      close(fd);
+      return;
+    }
+  }
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " PORT [--users N] [--salted] [--latency-ms N] [--jitter-ms N] [--error-percent N]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-fakedb", LOG_USER, LOG_PID | LOG_PERROR);
+  int port = atoi(argv[1]);
+  for(int i = 2; i < argc; i++) {
+    if(strcmp(argv[i], "--salted") == 0) {
+      salted = true;
+    } else if(i + 1 < argc && strcmp(argv[i], "--users") == 0) {
+      user_count = atol(argv[++i]);
+    } else if(i + 1 < argc && strcmp(argv[i], "--latency-ms") == 0) {
+      latency_ms = atoi(argv[++i]);
+    } else if(i + 1 < argc && strcmp(argv[i], "--jitter-ms") == 0) {
+      jitter_ms = atoi(argv[++i]);
+    } else if(i + 1 < argc && strcmp(argv[i], "--error-percent") == 0) {
+      error_percent = atoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown flag " << argv[i] << std::endl;
+      return 2;
+    }
+  }
+  if(port <= 0 || port > 65535 || user_count < 0 || latency_ms < 0 || jitter_ms < 0 || error_percent < 0 || error_percent > 100) {
+    std::cerr << "Invalid port or flag value" << std::endl;
+    return 2;
+  }
+
+  // no SA_RESTART, so accept returns when we are asked to stop
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int on = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  // only reachable from this host, nothing here is authenticated
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 1024) != 0) {
+    std::cerr << "Could not listen on 127.0.0.1:" << port << ": " << ErrnoString(errno) << std::endl;
+    return 1;
+  }
+  std::cout << "Serving " << user_count << (salted ? " salted" : "") << " users on http://127.0.0.1:" << port << std::endl;
+
+  while(running) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(errno != EINTR) {
+        LOG(kLogErr) << "accept failed: " << ErrnoString(errno);
+        sleep(1);
+      }
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // a thread per connection, the SDK keeps a small pool of connections per client
+    std::thread(serve, fd).detach();
+  }
+
+  close(listen_fd);
+  std::cout << "found=" << found_count << " not_found=" << not_found_count << " errors=" << error_count
+            << " bad_requests=" << bad_count << std::endl;
+  return 0;
+}
\ No newline at end of file
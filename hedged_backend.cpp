@@ -0,0 +1,294 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <thread>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "HedgedBackend.h"
+#include "Log.h"
+#include "Stats.h"
+
+const int kLatencySamples = 64;
+// below this many reads the percentile is not trusted and hedge_delay_ms is used
+const int kLatencyMinSamples = 8;
+// a failed read adds a penalty of at least this to a backend's average, doubling while it keeps failing, so it drops
+// to the back of the order
+const double kLatencyFailedUs = 100000;
+const double kLatencyMaxPenaltyUs = 10000000;
+// the penalty halves every this many seconds, so a region which has been demoted is read from again once it has had
+// time to recover, and a read which succeeds clears it
+const double kLatencyPenaltyHalfLifeS = 5;
+
+// recent read latencies for one backend
+struct LatencyEstimate {
+  std::mutex mutex;
+  uint64_t samples_us[kLatencySamples];
+  int count;
+  int next;
+  double average_us;
+  double penalty_us;
+  uint64_t penalty_ns;
+
+  LatencyEstimate() : count(0), next(0), average_us(0), penalty_us(0), penalty_ns(0) {}
+
+  // what is left of the failure penalty, called with the mutex held
+  double penalty(uint64_t now_ns) {
+    if(penalty_us == 0) {
+      return 0;
+    }
+    return penalty_us * exp2(-(double)(now_ns - penalty_ns) / 1e9 / kLatencyPenaltyHalfLifeS);
+  }
+
+  void record(uint64_t us, bool failed) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = stat_now_ns();
+    if(failed) {
+      penalty_us = std::min(std::max(penalty(now) * 2, kLatencyFailedUs), kLatencyMaxPenaltyUs);
+      penalty_ns = now;
+      return;
+    }
+    penalty_us = 0;
+    // exponentially weighted, so the order follows a region which has slowed down or sped up after a few reads
+    average_us = count == 0 ? us : average_us * 0.8 + us * 0.2;
+    samples_us[next] = us;
+    next = (next + 1) % kLatencySamples;
+    count = std::min(count + 1, kLatencySamples);
+  }
+
+  double average() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return average_us + penalty(stat_now_ns());
+  }
+
+  // microseconds below which the given percentage of recent reads finished, 0 if there are too few to say
+  uint64_t percentile(int p) {
+    uint64_t sorted[kLatencySamples];
+    int n = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      n = count;
+      std::copy(samples_us, samples_us + n, sorted);
+    }
+    if(n < kLatencyMinSamples) {
+      return 0;
+    }
+    int index = std::min(n - 1, n * p / 100);
+    std::nth_element(sorted, sorted + index, sorted + n);
+    return sorted[index];
+  }
+};
+
+// estimates by backend name, never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::mutex estimates_mutex;
+static std::map<std::string, LatencyEstimate*>& estimates = *new std::map<std::string, LatencyEstimate*>();
+
+LatencyEstimate *estimate_for(const std::string& name) {
+  std::lock_guard<std::mutex> lock(estimates_mutex);
+  LatencyEstimate *&estimate = estimates[name];
+  if(estimate == NULL) {
+    estimate = new LatencyEstimate();
+  }
+  return estimate;
+}
+
+// threads running reads for this process, reads are handed to them only when hedging may need a second read
+// running at the same time as the first
+const int kReadWorkers = 4;
+
+// milliseconds an exiting process waits for reads in the middle of a backend call
+const int kReadExitWaitMs = 5;
+
+// one fetch shared between the caller and the reads it starts, the reads which lose carry on in the
+// background and only update the latency estimates
+struct HedgeCall {
+  std::mutex mutex;
+  std::condition_variable cv;
+  int running = 0;
+  bool answered = false;
+  int result = FETCH_ERROR;
+  CacheRecord record;
+};
+
+// the read threads, started on first use (and again after a fork)
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+struct ReadPool {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> waiting;
+  std::vector<std::thread*> workers;
+  int idle = 0;
+  int running = 0;
+  bool stopping = false;
+  pid_t pid = 0;
+};
+
+static ReadPool& read_pool = *new ReadPool();
+
+void run_reads() {
+  ReadPool& q = read_pool;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  while(true) {
+    q.idle++;
+    q.cv.wait(lock, [&q] { return q.stopping || !q.waiting.empty(); });
+    q.idle--;
+    if(q.stopping) {
+      return;
+    }
+    std::function<void()> read = q.waiting.front();
+    q.waiting.pop_front();
+    q.running++;
+    lock.unlock();
+    read();
+    lock.lock();
+    q.running--;
+    q.cv.notify_all();
+  }
+}
+
+// hands a read to an idle read thread, false if there is none (e.g. they are all busy with reads which lost)
+bool pool_read(const std::function<void()>& read) {
+  ReadPool& q = read_pool;
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if(q.pid != getpid()) {
+    // forked, the parent's threads do not exist here
+    q.waiting.clear();
+    q.workers.clear();
+    q.idle = 0;
+    q.running = 0;
+    q.pid = getpid();
+  }
+  if(q.stopping) {
+    return false;
+  }
+  if(q.workers.empty()) {
+    for(int i = 0; i < kReadWorkers; i++) {
+      q.workers.push_back(new std::thread(run_reads));
+    }
+  } else if(q.idle <= (int)q.waiting.size()) {
+    return false;
+  }
+  q.waiting.push_back(read);
+  q.cv.notify_one();
+  return true;
+}
+
+// runs when the process exits, nobody is waiting for the answers of reads still running so they are only waited for
+// briefly and then left to end with the process, the module is never unloaded so their code stays mapped until then
+__attribute__((destructor))
+static void stop_reads() {
+  ReadPool& q = read_pool;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  if(q.workers.empty() || q.pid != getpid()) {
+    return;
+  }
+  q.stopping = true;
+  q.waiting.clear();
+  q.cv.notify_all();
+  bool finished = q.cv.wait_for(lock, std::chrono::milliseconds(kReadExitWaitMs), [&q] { return q.running == 0; });
+  lock.unlock();
+  for(std::thread *worker : q.workers) {
+    if(finished) {
+      worker->join();
+    } else {
+      worker->detach();
+    }
+  }
+}
+
+// starts a read for the call, on a read thread if others may need to run alongside it and one is free, otherwise on
+// the calling thread, which then holds lock again once the read is done
+void start_read(std::shared_ptr<HedgeCall> call, std::unique_lock<std::mutex>& lock, bool alongside,
+                std::shared_ptr<CredentialBackend> backend, LatencyEstimate *estimate,
+                const std::string& name, const std::string& realm, const std::string& username) {
+  call->running++;
+  std::function<void()> read = [call, backend, estimate, name, realm, username]() {
+    uint64_t started = stat_now_ns();
+    CacheRecord record = CacheRecord();
+    int result = backend->fetch(realm, username, record);
+    estimate->record((stat_now_ns() - started) / 1000, result == FETCH_ERROR);
+    std::lock_guard<std::mutex> lock(call->mutex);
+    call->running--;
+    if(!call->answered && result != FETCH_ERROR) {
+      LOG(kLogDebug) << "First answer came from " << name;
+      call->answered = true;
+      call->result = result;
+      call->record = record;
+    }
+    call->cv.notify_all();
+  };
+  if(alongside && pool_read(read)) {
+    return;
+  }
+  lock.unlock();
+  read();
+  lock.lock();
+}
+
+HedgedBackend::HedgedBackend(std::vector<std::string> p_names, std::vector<std::shared_ptr<CredentialBackend>> p_backends, int p_hedge_percentile, int p_hedge_delay_ms) {
+  names = p_names;
+  backends = p_backends;
+  hedge_percentile = p_hedge_percentile;
+  hedge_delay_ms = p_hedge_delay_ms;
+}
+
+int HedgedBackend::fetch(const std::string& realm, const std::string& username, CacheRecord& record) {
+  if(backends.size() == 1) {
+    return backends[0]->fetch(realm, username, record);
+  }
+
+  // quickest first, ties (e.g. no reads yet) keep the configured order
+  std::vector<size_t> order;
+  std::vector<LatencyEstimate*> estimate;
+  std::vector<double> average;
+  for(size_t i = 0; i < backends.size(); i++) {
+    order.push_back(i);
+    estimate.push_back(estimate_for(names[i]));
+    average.push_back(estimate[i]->average());
+  }
+  std::stable_sort(order.begin(), order.end(), [&average](size_t a, size_t b) { return average[a] < average[b]; });
+
+  std::shared_ptr<HedgeCall> call = std::make_shared<HedgeCall>();
+  std::unique_lock<std::mutex> lock(call->mutex);
+  size_t started = 0;
+  // without hedging each read is only started once the one before has failed, so they all run on this thread
+  bool hedging = hedge_percentile > 0;
+  LOG(kLogDebug) << "Reading from " << names[order[0]];
+  start_read(call, lock, hedging, backends[order[0]], estimate[order[0]], names[order[0]], realm, username);
+  started++;
+  auto finished = [&call] { return call->answered || call->running == 0; };
+  while(true) {
+    bool more = started < order.size();
+    if(more && hedging) {
+      LatencyEstimate *last = estimate[order[started - 1]];
+      std::chrono::microseconds delay(std::max((uint64_t)hedge_delay_ms * 1000, last->percentile(hedge_percentile)));
+      call->cv.wait_for(lock, delay, finished);
+    } else {
+      call->cv.wait(lock, finished);
+    }
+    if(call->answered || !more) {
+      break;
+    }
+    // either the reads so far are slow or they have all failed, bring in the next backend
+    size_t next = order[started];
+    if(call->running > 0) {
+      LOG(kLogInfo) << "No answer from " << names[order[started - 1]] << " yet, also reading from " << names[next];
+      stat_add(STAT_BACKEND_HEDGED);
+    } else {
+      LOG(kLogWarning) << "Read from " << names[order[started - 1]] << " failed, trying " << names[next];
+    }
+    start_read(call, lock, hedging && (call->running > 0 || started + 1 < order.size()), backends[next], estimate[next], names[next], realm, username);
+    started++;
+  }
+  if(!call->answered) {
+    return FETCH_ERROR;
+  }
+  record = call->record;
+  return call->result;
+}
\ No newline at end of file
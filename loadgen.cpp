@@ -0,0 +1,355 @@
+// pam-dynamo-loadgen, logs synthetic users in through libpam from many threads and processes and reports
+// throughput and latency, for load testing the module end to end
+//
+// usage: pam-dynamo-loadgen SERVICE [--threads N] [--processes N] [--seconds N] [--users N] [--hot N]
+//                           [--mix hit=H,miss=M,unknown=U,badpass=B] [--confdir DIR]
+//
+// SERVICE is a pam.d service whose auth stack uses the module, normally pointed at pam-dynamo-fakedb, --users
+// must match the fake table, each login is one of
+//   hit      one of the first --hot users with the right password, these are logged in once before timing starts
+//            so they are served from the cache
+//   miss     a user after the hot ones with the right password, taken in turn so each is new until they run out
+//   unknown  a username the table does not have
+//   badpass  a hot user with the wrong password
+// in the proportions given by --mix, --confdir reads SERVICE from DIR instead of /etc/pam.d where libpam supports it
+// with more than one process the parent looks an unknown user up before forking, so the workers run on the module
+// and SDK state a forking service would hand its children, and a worker which hangs is killed and reported
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#include "SyntheticUsers.h"
+
+// how long after its timed run a worker process is killed, e.g. if a lookup hangs
+const int kWorkerGraceSeconds = 60;
+
+enum LoginKind {
+  LOGIN_HIT,
+  LOGIN_MISS,
+  LOGIN_UNKNOWN,
+  LOGIN_BADPASS,
+  LOGIN_KIND_COUNT
+};
+
+static const char *LOGIN_KIND_NAMES[LOGIN_KIND_COUNT] = { "hit", "miss", "unknown", "badpass" };
+
+// one timed login, also what a worker process sends back to the parent
+struct Sample {
+  uint64_t ns;
+  uint8_t kind;
+  // the module gave the answer the kind should get
+  uint8_t expected;
+};
+
+struct LoadSettings {
+  const char *service;
+  const char *confdir;
+  int threads;
+  int processes;
+  int seconds;
+  long users;
+  long hot;
+  int mix[LOGIN_KIND_COUNT];
+};
+
+// answers the module's password prompt
+int answer_prompt(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr) {
+  struct pam_response *replies = (struct pam_response *)calloc(num_msg, sizeof(struct pam_response));
+  if(replies == NULL) {
+    return PAM_BUF_ERR;
+  }
+  for(int i = 0; i < num_msg; i++) {
+    if(msg[i]->msg_style == PAM_PROMPT_ECHO_OFF || msg[i]->msg_style == PAM_PROMPT_ECHO_ON) {
+      replies[i].resp = strdup((const char *)appdata_ptr);
+    }
+  }
+  *resp = replies;
+  return PAM_SUCCESS;
+}
+
+// a whole login as a service would do it, from pam_start to pam_end, returns the pam_authenticate result
+int login(const LoadSettings& settings, const std::string& username, const std::string& password) {
+  struct pam_conv conv = { answer_prompt, (void *)password.c_str() };
+  pam_handle_t *pamh = NULL;
+  int rc;
+#ifdef HAVE_PAM_START_CONFDIR
+  if(settings.confdir != NULL) {
+    rc = pam_start_confdir(settings.service, username.c_str(), &conv, settings.confdir, &pamh);
+  } else
+#endif
+  rc = pam_start(settings.service, username.c_str(), &conv, &pamh);
+  if(rc != PAM_SUCCESS) {
+    return rc;
+  }
+  rc = pam_authenticate(pamh, 0);
+  pam_end(pamh, rc);
+  return rc;
+}
+
+// logs in as fast as it can until the deadline, picking each login's kind at random by the mix
+void run_thread(const LoadSettings& settings, int process, int thread, std::atomic<long>& next_miss,
+                std::chrono::steady_clock::time_point deadline, std::vector<Sample>& samples) {
+  std::mt19937_64 rng(std::random_device{}());
+  int total = 0;
+  for(int k = 0; k < LOGIN_KIND_COUNT; k++) {
+    total += settings.mix[k];
+  }
+  long cold = std::max(settings.users - settings.hot, 1L);
+  long unknown = 0;
+  while(std::chrono::steady_clock::now() < deadline) {
+    int pick = (int)(rng() % total);
+    int kind = 0;
+    while(pick >= settings.mix[kind]) {
+      pick -= settings.mix[kind++];
+    }
+    long hot = (long)(rng() % settings.hot);
+    std::string username;
+    std::string password;
+    if(kind == LOGIN_HIT || kind == LOGIN_BADPASS) {
+      username = synthetic_username(hot);
+      password = kind == LOGIN_HIT ? synthetic_password(hot) : "wrong" + synthetic_password(hot);
+    } else if(kind == LOGIN_MISS) {
+      // processes take every processes'th cold user, so they do not repeat each other's
+      long i = settings.hot + (process + settings.processes * next_miss++) % cold;
+      username = synthetic_username(i);
+      password = synthetic_password(i);
+    } else {
+      username = "nouser-" + std::to_string(getpid()) + "-" + std::to_string(thread) + "-" + std::to_string(unknown++);
+      password = "password";
+    }
+    auto started = std::chrono::steady_clock::now();
+    int rc = login(settings, username, password);
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    bool should_pass = kind == LOGIN_HIT || kind == LOGIN_MISS;
+    samples.push_back({ ns, (uint8_t)kind, (uint8_t)((rc == PAM_SUCCESS) == should_pass) });
+  }
+}
+
+// one process's share of the load, the hot users are logged in first so they are cached
+std::vector<Sample> run_process(const LoadSettings& settings, int process) {
+  for(long i = 0; i < settings.hot; i++) {
+    int rc = login(settings, synthetic_username(i), synthetic_password(i));
+    if(rc != PAM_SUCCESS && process == 0 && i == 0) {
+      std::cerr << "Warning: warm up login of " << synthetic_username(i) << " failed: " << pam_strerror(NULL, rc) << std::endl;
+    }
+  }
+  std::atomic<long> next_miss(0);
+  std::vector<std::vector<Sample>> per_thread(settings.threads);
+  std::vector<std::thread> threads;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(settings.seconds);
+  for(int t = 0; t < settings.threads; t++) {
+    threads.push_back(std::thread(run_thread, std::cref(settings), process, t, std::ref(next_miss), deadline, std::ref(per_thread[t])));
+  }
+  std::vector<Sample> samples;
+  for(int t = 0; t < settings.threads; t++) {
+    threads[t].join();
+    samples.insert(samples.end(), per_thread[t].begin(), per_thread[t].end());
+  }
+  return samples;
+}
+
+bool write_all(int fd, const void *buffer, size_t length) {
+  const char *at = (const char *)buffer;
+  while(length > 0) {
+    ssize_t n = write(fd, at, length);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      return false;
+    }
+    at += n;
+    length -= n;
+  }
+  return true;
+}
+
+// forks a worker per process, each sends its samples back over a pipe once it is done
+bool run_processes(const LoadSettings& settings, std::vector<Sample>& samples) {
+  // an unknown user always reaches the backend, so the module has initialised the SDK and made a call before the
+  // workers are forked, as it has in e.g. a daemon which authenticates and then forks a child per connection
+  int rc = login(settings, "nouser-" + std::to_string(getpid()) + "-parent", "password");
+  if(rc == PAM_SUCCESS) {
+    std::cerr << "Warning: login of an unknown user before forking succeeded" << std::endl;
+  }
+  std::vector<int> pipes;
+  for(int p = 0; p < settings.processes; p++) {
+    int fds[2];
+    if(pipe(fds) != 0) {
+      std::cerr << "Could not create pipe: " << strerror(errno) << std::endl;
+      return false;
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+      std::cerr << "Could not fork: " << strerror(errno) << std::endl;
+      return false;
+    }
+    if(pid == 0) {
+      close(fds[0]);
+      alarm(settings.seconds + kWorkerGraceSeconds);
+      std::vector<Sample> mine = run_process(settings, p);
+      // exit rather than _exit, so the module's exit hooks (e.g. flushing queued cache writes) still run
+      exit(write_all(fds[1], mine.data(), mine.size() * sizeof(Sample)) ? 0 : 1);
+    }
+    close(fds[1]);
+    pipes.push_back(fds[0]);
+  }
+  // the workers only write once they have finished, so reading them in turn cannot hold any of them up for long
+  for(int fd : pipes) {
+    Sample sample;
+    size_t got = 0;
+    ssize_t n;
+    while((n = read(fd, (char *)&sample + got, sizeof(sample) - got)) > 0 || (n < 0 && errno == EINTR)) {
+      got += n > 0 ? n : 0;
+      if(got == sizeof(sample)) {
+        samples.push_back(sample);
+        got = 0;
+      }
+    }
+    close(fd);
+  }
+  bool ok = true;
+  int status;
+  while(wait(&status) > 0) {
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  if(!ok) {
+    std::cerr << "A worker process failed, its results are missing" << std::endl;
+  }
+  return true;
+}
+
+// the latency below which fraction q of the sorted samples fall, in microseconds
+double quantile_us(const std::vector<uint64_t>& sorted, double q) {
+  if(sorted.empty()) {
+    return 0;
+  }
+  return sorted[(size_t)(q * (sorted.size() - 1))] / 1000.0;
+}
+
+void print_row(const char *name, std::vector<uint64_t>& ns, uint64_t unexpected, double seconds) {
+  std::sort(ns.begin(), ns.end());
+  std::cout << std::left << std::setw(10) << name << std::right << std::setw(10) << ns.size() << std::setw(12) << unexpected
+            << std::fixed << std::setprecision(1) << std::setw(12) << ns.size() / seconds
+            << std::setw(12) << quantile_us(ns, 0.5) << std::setw(12) << quantile_us(ns, 0.99)
+            << std::setw(12) << quantile_us(ns, 0.999) << std::endl;
+}
+
+void print_report(const std::vector<Sample>& samples, double seconds) {
+  std::vector<uint64_t> all;
+  std::vector<uint64_t> by_kind[LOGIN_KIND_COUNT];
+  uint64_t unexpected[LOGIN_KIND_COUNT + 1] = {};
+  for(const Sample& s : samples) {
+    all.push_back(s.ns);
+    by_kind[s.kind].push_back(s.ns);
+    if(!s.expected) {
+      unexpected[s.kind]++;
+      unexpected[LOGIN_KIND_COUNT]++;
+    }
+  }
+  std::cout << std::left << std::setw(10) << "kind" << std::right << std::setw(10) << "logins" << std::setw(12) << "unexpected"
+            << std::setw(12) << "per_sec" << std::setw(12) << "p50_us" << std::setw(12) << "p99_us" << std::setw(12) << "p999_us" << std::endl;
+  for(int k = 0; k < LOGIN_KIND_COUNT; k++) {
+    print_row(LOGIN_KIND_NAMES[k], by_kind[k], unexpected[k], seconds);
+  }
+  print_row("all", all, unexpected[LOGIN_KIND_COUNT], seconds);
+}
+
+// reads hit=H,miss=M,unknown=U,badpass=B, kinds left out get 0
+bool parse_mix(const char *arg, int *mix) {
+  std::fill(mix, mix + LOGIN_KIND_COUNT, 0);
+  std::string rest(arg);
+  while(!rest.empty()) {
+    size_t comma = rest.find(',');
+    std::string part = rest.substr(0, comma);
+    rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+    size_t equals = part.find('=');
+    int k = 0;
+    while(k < LOGIN_KIND_COUNT && (equals == std::string::npos || part.compare(0, equals, LOGIN_KIND_NAMES[k]) != 0)) {
+      k++;
+    }
+    if(k == LOGIN_KIND_COUNT || (mix[k] = atoi(part.c_str() + equals + 1)) < 0) {
+      return false;
+    }
+  }
+  int total = 0;
+  for(int k = 0; k < LOGIN_KIND_COUNT; k++) {
+    total += mix[k];
+  }
+  return total > 0;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 2) {
+    std::cerr << "usage: " << argv[0] << " SERVICE [--threads N] [--processes N] [--seconds N] [--users N] [--hot N]" << std::endl
+              << "       [--mix hit=H,miss=M,unknown=U,badpass=B] [--confdir DIR]" << std::endl;
+    return 2;
+  }
+  LoadSettings settings = { argv[1], NULL, 4, 1, 10, 1000, 100, { 90, 5, 3, 2 } };
+  for(int i = 2; i < argc; i++) {
+    if(i + 1 >= argc) {
+      std::cerr << "Missing value for " << argv[i] << std::endl;
+      return 2;
+    }
+    const char *value = argv[++i];
+    if(strcmp(argv[i - 1], "--threads") == 0) {
+      settings.threads = atoi(value);
+    } else if(strcmp(argv[i - 1], "--processes") == 0) {
+      settings.processes = atoi(value);
+    } else if(strcmp(argv[i - 1], "--seconds") == 0) {
+      settings.seconds = atoi(value);
+    } else if(strcmp(argv[i - 1], "--users") == 0) {
+      settings.users = atol(value);
+    } else if(strcmp(argv[i - 1], "--hot") == 0) {
+      settings.hot = atol(value);
+    } else if(strcmp(argv[i - 1], "--mix") == 0) {
+      if(!parse_mix(value, settings.mix)) {
+        std::cerr << "Invalid mix " << value << ", expected e.g. hit=90,miss=5,unknown=3,badpass=2" << std::endl;
+        return 2;
+      }
+    } else if(strcmp(argv[i - 1], "--confdir") == 0) {
+#ifdef HAVE_PAM_START_CONFDIR
+      settings.confdir = value;
+#else
+      std::cerr << "This libpam does not support --confdir, put the service in /etc/pam.d" << std::endl;
+      return 2;
+#endif
+    } else {
+      std::cerr << "Unknown flag " << argv[i - 1] << std::endl;
+      return 2;
+    }
+  }
+  if(settings.threads < 1 || settings.processes < 1 || settings.seconds < 1 || settings.hot < 1 || settings.users <= settings.hot) {
+    std::cerr << "--threads, --processes, --seconds and --hot must be at least 1, and --users more than --hot" << std::endl;
+    return 2;
+  }
+
+  std::cout << "Logging in to " << settings.service << " from " << settings.processes << " x " << settings.threads
+            << " threads for " << settings.seconds << "s" << std::endl;
+  std::vector<Sample> samples;
+  if(settings.processes == 1) {
+    samples = run_process(settings, 0);
+  } else if(!run_processes(settings, samples)) {
+    return 1;
+  }
+  if(samples.empty()) {
+    std::cerr << "No logins were made" << std::endl;
+    return 1;
+  }
+  print_report(samples, settings.seconds);
+  return 0;
+}
\ No newline at end of file
@@ -1,36 +1,84 @@
 #include <cstring>
-#include <ostream>
+#include <mutex>
 
 #include "Log.h"
 
-Log::Log(std::string ident, int facility) {
-    facility_ = facility;
-    priority_ = LOG_DEBUG;
-    strncpy(ident_, ident.c_str(), sizeof(ident_));
-    ident_[sizeof(ident_)-1] = '\0';
+// messages are queued and handed to syslog in batches, at the end of each module call (log_flush), when the
+// queue fills, when an error or worse is logged, and when the process exits
+const int kLogQueueSize = 64;
 
-    openlog(ident_, LOG_PID, facility_);
+struct QueuedLine {
+    int priority;
+    char text[kLogLineMax];
+};
+
+std::atomic<int> log_level(LOG_INFO);
+thread_local int log_call_level = -1;
+
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::once_flag log_once;
+static std::mutex& log_mutex = *new std::mutex();
+static QueuedLine *log_queue = new QueuedLine[kLogQueueSize];
+static int log_queued = 0;
+static char log_ident[50];
+
+void log_init(const char *ident, int facility, int option) {
+    std::call_once(log_once, [&]() {
+        strncpy(log_ident, ident, sizeof(log_ident));
+        log_ident[sizeof(log_ident)-1] = '\0';
+        openlog(log_ident, option, facility);
+    });
+}
+
+void log_set_level(int level) {
+    log_level.store(level, std::memory_order_relaxed);
+}
+
+// log_mutex must be held
+static void write_queued() {
+    for (int i = 0; i < log_queued; i++) {
+        syslog(log_queue[i].priority, "%s", log_queue[i].text);
+    }
+    log_queued = 0;
+}
+
+void log_flush() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    write_queued();
 }
 
-int Log::sync() {
-    if (buffer_.length()) {
-        syslog(priority_, "%s", buffer_.c_str());
-        buffer_.erase();
-        priority_ = LOG_DEBUG; // default to debug for each message
+ErrnoString::ErrnoString(int err) {
+    // the GNU strerror_r may return a static string rather than filling in text
+    const char *message = strerror_r(err, text, sizeof(text));
+    if (message != text) {
+        strncpy(text, message, sizeof(text));
+        text[sizeof(text)-1] = '\0';
     }
-    return 0;
 }
 
-int Log::overflow(int c) {
-    if (c != EOF) {
-        buffer_ += static_cast<char>(c);
-    } else {
-        sync();
+std::ostream& operator<<(std::ostream& out, const ErrnoString& error) {
+    return out << error.text;
+}
+
+LogLine::LogLine(int priority) : priority_(priority), stream_(this) {
+    // leave room for the terminating nul
+    setp(buffer_, buffer_ + sizeof(buffer_) - 1);
+}
+
+LogLine::~LogLine() {
+    size_t length = pptr() - pbase();
+    std::lock_guard<std::mutex> lock(log_mutex);
+    QueuedLine& line = log_queue[log_queued++];
+    line.priority = priority_;
+    memcpy(line.text, buffer_, length);
+    line.text[length] = '\0';
+    if (log_queued == kLogQueueSize || priority_ <= LOG_ERR) {
+        write_queued();
     }
-    return c;
 }
 
-std::ostream& operator<< (std::ostream& os, const LogPriority& log_priority) {
-    static_cast<Log *>(os.rdbuf())->priority_ = (int)log_priority;
-    return os;
+// runs when the process exits
+__attribute__((destructor))
+static void flush_at_exit() {
+    log_flush();
 }
\ No newline at end of file
@@ -4,8 +4,12 @@
 #include <security/pam_ext.h>
 #include <string.h>
 
+#include "Authd.h"
+#include "CallContext.h"
 #include "User.h"
 #include "Log.h"
+#include "Options.h"
+#include "Stats.h"
 
 // external defs
 extern "C" int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv);
@@ -17,15 +21,19 @@ PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const cha
   return PAM_SUCCESS;
 }
 
-PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv) {
-  // dummy, does not do anything
-  return PAM_SUCCESS;
-}
-
-PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+static int authenticate(pam_handle_t *pamh, int argc, const char **argv) {
   int ret_val;
 
-  std::clog.rdbuf(new Log("libpam-dynamo", LOG_LOCAL0));
+  // options come first so the log level applies to everything below
+  // they only apply to this thread, so threaded hosts can run several calls at once
+  Options opts;
+  parse_options(argc, argv, 5, opts);
+  CallContext context(opts);
+  StageTimer timer(STAGE_AUTHENTICATE);
+  if(argc < 5) {
+    LOG(kLogErr) << "Expected REGION TABLE REALM CACHE_FOLDER CACHE_DURATION arguments, got " << argc << " arguments";
+    return PAM_SERVICE_ERR;
+  }
 
   // get the username
   const char* pam_username;
@@ -52,23 +60,99 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
   try {
     I_CACHE_DUR = std::atoi(CACHE_DUR.c_str());
   } catch(std::invalid_argument const &e) {
-    std::clog << kLogErr << "Could not convert " << CACHE_DUR << " to integer: invalid.  Using default = 60" << std::endl;
+    LOG(kLogErr) << "Could not convert " << CACHE_DUR << " to integer: invalid.  Using default = 60";
   } catch(std::out_of_range const &e) {
-    std::clog << kLogErr << "Could not convert " << CACHE_DUR << " to integer: overflow.  Using default = 60" << std::endl;
+    LOG(kLogErr) << "Could not convert " << CACHE_DUR << " to integer: overflow.  Using default = 60";
   }
 
   std::string s_pam_username(pam_username, strlen(pam_username));
   std::string s_pam_authtok(pam_authtok, strlen(pam_authtok));
 
-  std::clog << kLogInfo << "REGION = " << REGION << ", TABLE = " << TABLE << ", REALM = " << REALM << ", USER = " << s_pam_username << std::endl;
-  std::clog << kLogInfo << "CACHE FOLDER = " << CACHE_LOC << ", SESSION_DUR = " << CACHE_DUR << std::endl;
+  LOG(kLogInfo) << "REGION = " << REGION << ", TABLE = " << TABLE << ", REALM = " << REALM << ", USER = " << s_pam_username;
+  LOG(kLogDebug) << "CACHE FOLDER = " << CACHE_LOC << ", SESSION_DUR = " << CACHE_DUR;
 
-  User u(REGION, TABLE, REALM, CACHE_LOC, I_CACHE_DUR, s_pam_username);
-  if(u.authenticate(s_pam_authtok)) {
-    std::clog << kLogInfo << "Returning PAM_SUCCESS" << std::endl;
+  // let the daemon answer if there is one, it keeps clients and caches warm between logins
+  int result = AUTHD_UNAVAILABLE;
+  if(!opts.authd_socket.empty()) {
+    result = authd_authenticate(opts.authd_socket, opts.authd_timeout_ms, argc, argv, s_pam_username, s_pam_authtok);
+    if(result == AUTHD_UNAVAILABLE) {
+      LOG(kLogWarning) << "authd unavailable, authenticating in process";
+    }
+  }
+  if(result == AUTHD_UNAVAILABLE) {
+    User u(REGION, TABLE, REALM, CACHE_LOC, I_CACHE_DUR, s_pam_username, opts);
+    result = authd_result(u.check_password(s_pam_authtok));
+  }
+  if(result == AUTHD_SUCCESS) {
+    LOG(kLogInfo) << "Returning PAM_SUCCESS";
+    stat_add(STAT_AUTH_SUCCESS);
     return PAM_SUCCESS;
+  } else if(result == AUTHD_MAXTRIES) {
+    LOG(kLogInfo) << "Returning PAM_MAXTRIES";
+    stat_add(STAT_AUTH_FAILURE);
+    return PAM_MAXTRIES;
   } else {
-    std::clog << kLogInfo << "Returning PAM_AUTH_ERR" << std::endl;
+    LOG(kLogInfo) << "Returning PAM_AUTH_ERR";
+    stat_add(STAT_AUTH_FAILURE);
     return PAM_AUTH_ERR;
   }
+}
+
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+  log_init("libpam-dynamo", LOG_LOCAL0);
+  int ret_val = authenticate(pamh, argc, argv);
+  // write out this call's log messages
+  log_flush();
+  return ret_val;
+}
+
+// checks the account fields of the record authentication cached, in process even with authd= since the cache is
+// shared, so an account check right after a login makes no backend call
+static int check_account(pam_handle_t *pamh, int argc, const char **argv) {
+  Options opts;
+  parse_options(argc, argv, 5, opts);
+  CallContext context(opts);
+  if(opts.account_checks == 0) {
+    // as before account checks were added, so an account line for this module does not start refusing logins
+    return PAM_SUCCESS;
+  }
+  if(argc < 5) {
+    LOG(kLogErr) << "Expected REGION TABLE REALM CACHE_FOLDER CACHE_DURATION arguments, got " << argc << " arguments";
+    return PAM_SERVICE_ERR;
+  }
+
+  const char* pam_username;
+  int ret_val = pam_get_user(pamh, &pam_username, "Username: ");
+  if (ret_val != PAM_SUCCESS) {
+    return ret_val;
+  }
+  std::string s_pam_username(pam_username, strlen(pam_username));
+  LOG(kLogInfo) << "Checking account, REALM = " << argv[2] << ", USER = " << s_pam_username;
+
+  User u(argv[0], argv[1], argv[2], argv[3], std::atoi(argv[4]), s_pam_username, opts);
+  switch(u.check_account()) {
+    case ACCOUNT_OK:
+      LOG(kLogInfo) << "Returning PAM_SUCCESS";
+      return PAM_SUCCESS;
+    case ACCOUNT_EXPIRED:
+      LOG(kLogInfo) << "Returning PAM_ACCT_EXPIRED";
+      return PAM_ACCT_EXPIRED;
+    case ACCOUNT_UNKNOWN:
+      LOG(kLogInfo) << "Returning PAM_USER_UNKNOWN";
+      return PAM_USER_UNKNOWN;
+    case ACCOUNT_UNAVAILABLE:
+      // fail closed, we could not tell whether the account is allowed
+      LOG(kLogInfo) << "Returning PAM_AUTH_ERR";
+      return PAM_AUTH_ERR;
+    default:
+      LOG(kLogInfo) << "Returning PAM_PERM_DENIED";
+      return PAM_PERM_DENIED;
+  }
+}
+
+PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+  log_init("libpam-dynamo", LOG_LOCAL0);
+  int ret_val = check_account(pamh, argc, argv);
+  log_flush();
+  return ret_val;
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Options.h"
+#include "Log.h"
+
+Options::Options() {
+  shm_cache_slots = 0;
+  process_cache_kb = 0;
+  process_cache_ttl = 5;
+  negative_user_ttl = 0;
+  negative_password_ttl = 0;
+  coalesce_wait_ms = 0;
+  cache_soft_ttl = 0;
+  stale_if_error = 0;
+  backend_timeout_ms = 0;
+  cache_shards = 1;
+  cache_wal = 1;
+  cache_mmap_mb = 16;
+  cache_busy_timeout_ms = 1000;
+  cache_max_rows = 0;
+  cache_sweep_interval = 300;
+  cache_write_behind = 0;
+  cache_write_queue = 1024;
+  user_calls_per_min = 0;
+  realm_calls_per_sec = 0;
+  max_inflight_calls = 0;
+  account_checks = 0;
+  authd_timeout_ms = 5000;
+  stats = 0;
+  hedge_percentile = 95;
+  hedge_delay_ms = 20;
+  log_level = LOG_INFO;
+}
+
+std::string Options::endpoint_for(const std::string& region) const {
+  auto found = endpoints.find(region);
+  return found == endpoints.end() ? std::string() : found->second;
+}
+
+bool parse_int(const std::string& name, const std::string& value, int& out) {
+  char *end = NULL;
+  long parsed = strtol(value.c_str(), &end, 10);
+  if(value.empty() || *end != '\0' || parsed < 0 || parsed > 1000000000) {
+    LOG(kLogErr) << "Could not convert " << name << "=" << value << " to a positive integer, ignoring it";
+    return false;
+  }
+  out = (int)parsed;
+  return true;
+}
+
+bool parse_level(const std::string& value, int& out) {
+  static const struct { const char *name; int level; } levels[] = {
+    { "err", LOG_ERR }, { "error", LOG_ERR }, { "warning", LOG_WARNING }, { "notice", LOG_NOTICE },
+    { "info", LOG_INFO }, { "debug", LOG_DEBUG }
+  };
+  for(const auto& level : levels) {
+    if(value == level.name) {
+      out = level.level;
+      return true;
+    }
+  }
+  LOG(kLogErr) << "Unknown log_level=" << value << ", expected one of error, warning, notice, info or debug";
+  return false;
+}
+
+// splits a comma separated list, skipping empty entries
+void parse_list(const std::string& value, std::vector<std::string>& out) {
+  out.clear();
+  size_t start = 0;
+  while(start <= value.length()) {
+    size_t end = value.find(',', start);
+    if(end == std::string::npos) {
+      end = value.length();
+    }
+    if(end > start) {
+      out.push_back(value.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+}
+
+void parse_options(int argc, const char **argv, int first, Options& opts) {
+  for(int i = first; i < argc; i++) {
+    const char *eq = strchr(argv[i], '=');
+    if(eq == NULL) {
+      LOG(kLogWarning) << "Ignoring argument without a value: " << argv[i];
+      continue;
+    }
+    std::string name(argv[i], eq - argv[i]);
+    std::string value(eq + 1);
+
+    if(name == "shm_cache") {
+      parse_int(name, value, opts.shm_cache_slots);
+    } else if(name == "process_cache_kb") {
+      parse_int(name, value, opts.process_cache_kb);
+    } else if(name == "process_cache_ttl") {
+      parse_int(name, value, opts.process_cache_ttl);
+    } else if(name == "neg_user_ttl") {
+      parse_int(name, value, opts.negative_user_ttl);
+    } else if(name == "neg_pass_ttl") {
+      parse_int(name, value, opts.negative_password_ttl);
+    } else if(name == "coalesce_wait_ms") {
+      parse_int(name, value, opts.coalesce_wait_ms);
+    } else if(name == "cache_soft_ttl") {
+      parse_int(name, value, opts.cache_soft_ttl);
+    } else if(name == "stale_if_error") {
+      parse_int(name, value, opts.stale_if_error);
+    } else if(name == "backend_timeout_ms") {
+      parse_int(name, value, opts.backend_timeout_ms);
+    } else if(name == "regions") {
+      parse_list(value, opts.regions);
+    } else if(name.compare(0, 9, "endpoint_") == 0 && name.length() > 9) {
+      opts.endpoints[name.substr(9)] = value;
+    } else if(name == "hedge_percentile") {
+      if(parse_int(name, value, opts.hedge_percentile) && opts.hedge_percentile > 99) {
+        LOG(kLogErr) << "hedge_percentile must be below 100, using 99";
+        opts.hedge_percentile = 99;
+      }
+    } else if(name == "hedge_delay_ms") {
+      parse_int(name, value, opts.hedge_delay_ms);
+    } else if(name == "snapshot") {
+      opts.snapshot_path = value;
+    } else if(name == "cache_shards") {
+      if(parse_int(name, value, opts.cache_shards) && (opts.cache_shards < 1 || opts.cache_shards > 256)) {
+        LOG(kLogErr) << "cache_shards must be between 1 and 256, using 1";
+        opts.cache_shards = 1;
+      }
+    } else if(name == "cache_wal") {
+      parse_int(name, value, opts.cache_wal);
+    } else if(name == "cache_mmap_mb") {
+      parse_int(name, value, opts.cache_mmap_mb);
+    } else if(name == "cache_busy_timeout_ms") {
+      parse_int(name, value, opts.cache_busy_timeout_ms);
+    } else if(name == "cache_max_rows") {
+      parse_int(name, value, opts.cache_max_rows);
+    } else if(name == "cache_sweep_interval") {
+      parse_int(name, value, opts.cache_sweep_interval);
+    } else if(name == "cache_write_behind") {
+      parse_int(name, value, opts.cache_write_behind);
+    } else if(name == "cache_write_queue") {
+      parse_int(name, value, opts.cache_write_queue);
+    } else if(name == "user_calls_per_min") {
+      parse_int(name, value, opts.user_calls_per_min);
+    } else if(name == "realm_calls_per_sec") {
+      parse_int(name, value, opts.realm_calls_per_sec);
+    } else if(name == "max_inflight_calls") {
+      parse_int(name, value, opts.max_inflight_calls);
+    } else if(name == "account_checks") {
+      parse_int(name, value, opts.account_checks);
+    } else if(name == "allowed_groups") {
+      parse_list(value, opts.allowed_groups);
+    } else if(name == "authd") {
+      opts.authd_socket = value;
+    } else if(name == "authd_timeout_ms") {
+      parse_int(name, value, opts.authd_timeout_ms);
+    } else if(name == "stats") {
+      parse_int(name, value, opts.stats);
+    } else if(name == "log_level") {
+      parse_level(value, opts.log_level);
+    } else {
+      LOG(kLogWarning) << "Ignoring unknown argument: " << name;
+    }
+  }
+}
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include <iostream>
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "KeyHash.h"
+#include "ProcessCache.h"
+#include "Stats.h"
+#include "Log.h"
+
+const int PROCESS_CACHE_SHARDS = 16;
+// rough cost of an entry's list node, map node and bucket on top of its strings
+const size_t PROCESS_ENTRY_OVERHEAD = 192;
+
+struct ProcessEntry {
+  std::string key;
+  CacheRecord record;
+  time_t cached_at;
+  size_t charge;
+};
+
+// most recently used entries are at the front of the list
+struct ProcessShard {
+  std::mutex lock;
+  std::list<ProcessEntry> lru;
+  std::unordered_map<std::string, std::list<ProcessEntry>::iterator> index;
+  size_t bytes;
+  size_t budget;
+};
+
+struct ProcessShards {
+  pid_t pid;
+  ProcessShard shards[PROCESS_CACHE_SHARDS];
+};
+
+static std::mutex process_cache_mutex;
+static std::atomic<ProcessShards*> process_cache(NULL);
+
+// the shards for this process, created on first use
+// a forked child starts with empty shards, the parent's are left alone as one of its threads may hold a lock
+ProcessShards *process_shards(int kb) {
+  pid_t pid = getpid();
+  ProcessShards *current = process_cache.load(std::memory_order_acquire);
+  if(current != NULL && current->pid == pid) {
+    return current;
+  }
+  std::lock_guard<std::mutex> lock(process_cache_mutex);
+  current = process_cache.load(std::memory_order_relaxed);
+  if(current != NULL && current->pid == pid) {
+    return current;
+  }
+  if(current != NULL) {
+    LOG(kLogInfo) << "Process forked, starting an empty process cache";
+  }
+  // never freed, threads may still be using the shards while the process exits
+  ProcessShards *created = new ProcessShards();
+  created->pid = pid;
+  for(ProcessShard& shard : created->shards) {
+    shard.bytes = 0;
+    shard.budget = (size_t)kb * 1024 / PROCESS_CACHE_SHARDS;
+  }
+  process_cache.store(created, std::memory_order_release);
+  LOG(kLogInfo) << "Using process cache of " << kb << "KB";
+  return created;
+}
+
+// the scope keeps apart caches of the same realm in different folders, tables or regions which share the process
+std::string process_key(const std::string& scope, const std::string& realm, const std::string& username) {
+  std::string key = scope;
+  key += '\0';
+  key += realm;
+  key += '\0';
+  key += username;
+  return key;
+}
+
+void drop_entry(ProcessShard& shard, std::list<ProcessEntry>::iterator entry) {
+  shard.bytes -= entry->charge;
+  shard.index.erase(entry->key);
+  shard.lru.erase(entry);
+}
+
+ProcessCache::ProcessCache(int p_kb, int p_ttl, const std::string& p_scope) {
+  kb = p_kb;
+  ttl = p_ttl;
+  scope = p_scope;
+}
+
+bool ProcessCache::get(const std::string& realm, const std::string& username, CacheRecord& record) {
+  if(kb <= 0) {
+    return false;
+  }
+  ProcessShard& shard = process_shards(kb)->shards[key_hash(realm, username) % PROCESS_CACHE_SHARDS];
+  std::string key = process_key(scope, realm, username);
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto entry = shard.index.find(key);
+    if(entry != shard.index.end()) {
+      if(ttl > 0 && entry->second->cached_at <= time(NULL) - ttl) {
+        drop_entry(shard, entry->second);
+      } else {
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry->second);
+        record = entry->second->record;
+        found = true;
+      }
+    }
+  }
+  stat_add(found ? STAT_PROCESS_HIT : STAT_PROCESS_MISS);
+  return found;
+}
+
+void ProcessCache::put(const std::string& realm, const std::string& username, const CacheRecord& record) {
+  if(kb <= 0) {
+    return;
+  }
+  ProcessShard& shard = process_shards(kb)->shards[key_hash(realm, username) % PROCESS_CACHE_SHARDS];
+  std::string key = process_key(scope, realm, username);
+  size_t charge = PROCESS_ENTRY_OVERHEAD + 2 * key.length() + record.password.length() + record.salt.length() + record.groups.length();
+
+  std::lock_guard<std::mutex> lock(shard.lock);
+  auto existing = shard.index.find(key);
+  if(existing != shard.index.end()) {
+    drop_entry(shard, existing->second);
+  }
+  if(charge > shard.budget) {
+    return;
+  }
+  shard.lru.push_front(ProcessEntry{key, record, time(NULL), charge});
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += charge;
+  while(shard.bytes > shard.budget) {
+    drop_entry(shard, std::prev(shard.lru.end()));
+  }
+}
+
+void ProcessCache::remove(const std::string& realm, const std::string& username) {
+  if(kb <= 0) {
+    return;
+  }
+  ProcessShard& shard = process_shards(kb)->shards[key_hash(realm, username) % PROCESS_CACHE_SHARDS];
+  std::string key = process_key(scope, realm, username);
+  std::lock_guard<std::mutex> lock(shard.lock);
+  auto existing = shard.index.find(key);
+  if(existing != shard.index.end()) {
+    drop_entry(shard, existing->second);
+  }
+}
\ No newline at end of file
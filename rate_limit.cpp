@@ -0,0 +1,307 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/sem.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "KeyHash.h"
+#include "Log.h"
+#include "RateLimit.h"
+#include "SegmentOwner.h"
+
+const char *LIMITS_NAME = "/pam-dynamo-limits";
+const uint32_t LIMITS_MAGIC = 0x50444c31; // PDL1, change if the layout below changes
+const uint32_t INFLIGHT_KEY = 0x50444931; // PDI1, the semaphore's key is this mixed with the user and the cap
+const int LIMIT_SLOTS = 4096;
+// a key can be in any of this many neighbouring slots, a new key takes the one idle for longest
+const int LIMIT_WAYS = 4;
+// token counts are kept in thousandths so slow refill rates are not lost to rounding
+const uint64_t MILLI = 1000;
+// the state word holds at most this many tokens
+const uint64_t LIMIT_MAX_TOKENS = 4000000;
+
+// a token bucket, state holds the time of the last refill in hundredths of a second (mod 2^32, so it wraps every
+// 497 days) in the high half and the tokens left in thousandths in the low half, 0 is a new (full) bucket
+struct LimitBucket {
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> state;
+};
+
+struct LimitsSegment {
+  std::atomic<uint32_t> magic;
+  uint32_t size;
+  LimitBucket buckets[LIMIT_SLOTS];
+};
+
+static std::mutex limits_mutex;
+static std::atomic<bool> limits_tried(false);
+static LimitsSegment *limits = NULL;
+
+// the caller has to define this for semctl
+union semun {
+  int val;
+  struct semid_ds *buf;
+  unsigned short *array;
+};
+
+// semaphore ids by cap, -1 for one which could not be opened, a process serving several pam.d files (e.g.
+// pam-dynamo-authd) can have more than one
+static std::map<int, int>& inflight_semids = *new std::map<int, int>();
+
+// maps the segment on first use, creating it if we are the first process to need it
+LimitsSegment *map_limits() {
+  std::string name = user_object_name(LIMITS_NAME);
+  bool created = true;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  }
+  if(fd < 0) {
+    LOG(kLogWarning) << "Could not open rate limit segment: " << ErrnoString(errno);
+    return NULL;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || !trusted_owner(st.st_uid, st.st_mode)) {
+    // e.g. created by another user with every bucket empty, so that every lookup would be rejected
+    LOG(kLogErr) << "Rate limit segment " << name << " belongs to another user or can be opened by others, not using it";
+    close(fd);
+    return NULL;
+  }
+  if(created && ftruncate(fd, sizeof(LimitsSegment)) != 0) {
+    LOG(kLogWarning) << "Could not size rate limit segment: " << ErrnoString(errno);
+    close(fd);
+    shm_unlink(name.c_str());
+    return NULL;
+  }
+  for(int i = 0; i < 100 && !created && (fstat(fd, &st) != 0 || st.st_size == 0); i++) {
+    // the creator has not sized it yet
+    usleep(1000);
+  }
+  if(!created && (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(LimitsSegment))) {
+    LOG(kLogWarning) << "Rate limit segment has an unexpected size, not using it";
+    close(fd);
+    return NULL;
+  }
+  void *addr = mmap(NULL, sizeof(LimitsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    LOG(kLogWarning) << "Could not map rate limit segment: " << ErrnoString(errno);
+    return NULL;
+  }
+  LimitsSegment *segment = (LimitsSegment*)addr;
+  if(created) {
+    // a fresh segment is zero filled, so every bucket is empty and unowned
+    segment->size = sizeof(LimitsSegment);
+    segment->magic.store(LIMITS_MAGIC, std::memory_order_release);
+  } else {
+    for(int i = 0; i < 100 && segment->magic.load(std::memory_order_acquire) != LIMITS_MAGIC; i++) {
+      usleep(1000);
+    }
+    if(segment->magic.load(std::memory_order_acquire) != LIMITS_MAGIC || segment->size != sizeof(LimitsSegment)) {
+      LOG(kLogWarning) << "Rate limit segment has an unexpected layout, not using it";
+      munmap(addr, sizeof(LimitsSegment));
+      return NULL;
+    }
+  }
+  return segment;
+}
+
+LimitsSegment *get_limits() {
+  if(limits_tried.load(std::memory_order_acquire)) {
+    return limits;
+  }
+  std::lock_guard<std::mutex> lock(limits_mutex);
+  if(!limits_tried.load(std::memory_order_relaxed)) {
+    limits = map_limits();
+    limits_tried.store(true, std::memory_order_release);
+  }
+  return limits;
+}
+
+uint32_t now_centiseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 100 + ts.tv_nsec / 10000000);
+}
+
+// finds the bucket for key, taking over the longest idle of its slots if it has none
+LimitBucket *find_bucket(LimitsSegment *segment, uint64_t key, uint32_t now) {
+  LimitBucket *group = &segment->buckets[(key % (LIMIT_SLOTS / LIMIT_WAYS)) * LIMIT_WAYS];
+  LimitBucket *idlest = group;
+  uint32_t idlest_for = 0;
+  for(int way = 0; way < LIMIT_WAYS; way++) {
+    if(group[way].key.load(std::memory_order_acquire) == key) {
+      return &group[way];
+    }
+    uint64_t state = group[way].state.load(std::memory_order_relaxed);
+    // an unused slot counts as idle for ever
+    uint32_t idle_for = state == 0 ? UINT32_MAX : now - (uint32_t)(state >> 32);
+    if(idle_for > idlest_for) {
+      idlest = &group[way];
+      idlest_for = idle_for;
+    }
+  }
+  // a race with another process taking the slot just means one of us starts with a full bucket
+  idlest->state.store(0, std::memory_order_relaxed);
+  idlest->key.store(key, std::memory_order_release);
+  return idlest;
+}
+
+// refills the bucket for the time since it was last used and takes a token if there is one
+// rate tokens are added every interval hundredths of a second, and the bucket holds at most rate tokens
+bool take_token(LimitBucket *bucket, uint64_t rate, uint32_t interval, uint32_t now) {
+  uint64_t capacity = std::min(rate, LIMIT_MAX_TOKENS) * MILLI;
+  uint64_t old_state = bucket->state.load(std::memory_order_relaxed);
+  while(true) {
+    uint32_t last = (uint32_t)(old_state >> 32);
+    uint64_t tokens = old_state & 0xffffffff;
+    if(old_state == 0) {
+      last = now;
+      tokens = capacity;
+    }
+    uint64_t elapsed = std::min(now - last, interval);
+    uint64_t refill = elapsed * rate * MILLI / interval;
+    if(refill > 0) {
+      // only move the refill time on when tokens were added, so frequent calls do not lose the fractions
+      tokens = std::min(tokens + refill, capacity);
+      last = now;
+    }
+    bool taken = tokens >= MILLI;
+    if(taken) {
+      tokens -= MILLI;
+    }
+    // keep a used bucket from looking new
+    uint64_t new_state = ((uint64_t)(last == 0 ? 1 : last) << 32) | tokens;
+    if(bucket->state.compare_exchange_weak(old_state, new_state, std::memory_order_relaxed)) {
+      return taken;
+    }
+  }
+}
+
+int take_backend_tokens(const std::string& realm, const std::string& username, const Options& opts) {
+  if(opts.user_calls_per_min <= 0 && opts.realm_calls_per_sec <= 0) {
+    return LIMIT_OK;
+  }
+  LimitsSegment *segment = get_limits();
+  if(segment == NULL) {
+    return LIMIT_OK;
+  }
+  uint32_t now = now_centiseconds();
+  if(opts.user_calls_per_min > 0) {
+    // zero marks an empty slot
+    uint64_t key = key_hash(realm, username) | 1;
+    if(!take_token(find_bucket(segment, key, now), opts.user_calls_per_min, 6000, now)) {
+      return LIMIT_USER;
+    }
+  }
+  if(opts.realm_calls_per_sec > 0) {
+    // user keys are odd and realm keys even, so the two cannot collide
+    uint64_t key = key_hash("", realm) & ~1ULL;
+    if(!take_token(find_bucket(segment, key == 0 ? 2 : key, now), opts.realm_calls_per_sec, 100, now)) {
+      return LIMIT_REALM;
+    }
+  }
+  return LIMIT_OK;
+}
+
+// the semaphore for this user and cap, so services configured with different caps each get the cap they asked for
+// rather than the first creator's, and one user cannot create another's
+key_t inflight_key(int max_inflight) {
+  key_t key = (key_t)((INFLIGHT_KEY ^ (uint32_t)key_hash(std::to_string(geteuid()), std::to_string(max_inflight))) & 0x7fffffff);
+  // 0 is IPC_PRIVATE
+  return key == IPC_PRIVATE ? (key_t)INFLIGHT_KEY : key;
+}
+
+// finds or creates the semaphore, the creator sets its value with semop so the others can tell from sem_otime
+// that it is ready
+int open_inflight_semaphore(int max_inflight) {
+  key_t key = inflight_key(max_inflight);
+  int semid = semget(key, 1, IPC_CREAT | IPC_EXCL | 0600);
+  if(semid >= 0) {
+    struct sembuf op = { 0, (short)std::min(max_inflight, 32767), 0 };
+    if(semop(semid, &op, 1) != 0) {
+      LOG(kLogWarning) << "Could not set up in-flight limit: " << ErrnoString(errno);
+      semctl(semid, 0, IPC_RMID);
+      return -1;
+    }
+    LOG(kLogInfo) << "Created in-flight limit of " << max_inflight << " backend calls";
+    return semid;
+  }
+  if(errno == EEXIST) {
+    semid = semget(key, 1, 0600);
+  }
+  if(semid < 0) {
+    LOG(kLogWarning) << "Could not open in-flight limit: " << ErrnoString(errno);
+    return -1;
+  }
+  struct semid_ds ds;
+  union semun arg;
+  arg.buf = &ds;
+  // the owner can be handed to someone else but the creator cannot, so both are checked
+  if(semctl(semid, 0, IPC_STAT, arg) != 0 || !trusted_owner(ds.sem_perm.uid, ds.sem_perm.mode) ||
+     !trusted_owner(ds.sem_perm.cuid, ds.sem_perm.mode)) {
+    // e.g. created by another user with no slots free, so that every lookup would be rejected
+    LOG(kLogErr) << "In-flight limit semaphore 0x" << std::hex << key << std::dec << " belongs to another user or can be used by others, not using it";
+    return -1;
+  }
+  for(int i = 0; i < 100; i++) {
+    if(semctl(semid, 0, IPC_STAT, arg) == 0 && ds.sem_otime != 0) {
+      return semid;
+    }
+    usleep(1000);
+  }
+  LOG(kLogWarning) << "In-flight limit was never initialised, not using it";
+  return -1;
+}
+
+int get_inflight_semaphore(int max_inflight) {
+  std::lock_guard<std::mutex> lock(limits_mutex);
+  auto found = inflight_semids.find(max_inflight);
+  if(found != inflight_semids.end()) {
+    return found->second;
+  }
+  int semid = open_inflight_semaphore(max_inflight);
+  inflight_semids[max_inflight] = semid;
+  return semid;
+}
+
+BackendSlot::BackendSlot(int max_inflight) {
+  semid = max_inflight > 0 ? get_inflight_semaphore(max_inflight) : -1;
+  held = false;
+  if(semid >= 0) {
+    // fail straight away rather than queueing logins behind a slow backend
+    struct sembuf op = { 0, -1, IPC_NOWAIT | SEM_UNDO };
+    int rc;
+    do {
+      rc = semop(semid, &op, 1);
+    } while(rc != 0 && errno == EINTR);
+    held = rc == 0;
+    if(!held && errno != EAGAIN) {
+      // e.g. removed with ipcrm, do without the cap
+      LOG(kLogWarning) << "Could not use in-flight limit: " << ErrnoString(errno);
+      semid = -1;
+    }
+  }
+}
+
+BackendSlot::~BackendSlot() {
+  if(held) {
+    struct sembuf op = { 0, 1, SEM_UNDO };
+    semop(semid, &op, 1);
+  }
+}
+
+bool BackendSlot::acquired() const {
+  return semid < 0 || held;
+}
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include <iostream>
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <stdint.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "KeyHash.h"
+#include "SegmentOwner.h"
+#include "ShmCache.h"
+#include "Log.h"
+
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::string& shm_cache_name = *new std::string("/pam-dynamo-cache");
+const uint32_t SHM_CACHE_MAGIC = 0x50444333; // PDC3, change if the entry layout changes
+const int SHM_PROBE_LIMIT = 8;
+// microseconds remove waits for another writer to let go of an entry, one still held after this has died mid write
+const int SHM_REMOVE_WAIT_US = 10000;
+
+// layout of one entry in the segment
+// seq is even when the entry is stable and odd while a writer owns it
+struct ShmEntry {
+  std::atomic<uint32_t> seq;
+  int32_t timestamp;
+  uint64_t key_hash;
+  // hash of the cache scope (folder, table and region) the entry was written for
+  uint64_t scope;
+  int64_t expires_at;
+  uint8_t salted;
+  // ACCOUNT_KNOWN and ACCOUNT_ENABLED
+  uint8_t account;
+  char realm[64];
+  char username[128];
+  char password[72];
+  char salt[72];
+  char groups[128];
+};
+
+const uint8_t ACCOUNT_KNOWN = 1;
+const uint8_t ACCOUNT_ENABLED = 2;
+
+struct ShmHeader {
+  std::atomic<uint32_t> magic;
+  uint32_t slots;
+};
+
+static std::mutex shm_mutex;
+static std::atomic<bool> shm_tried(false);
+static ShmHeader *shm_header = NULL;
+static ShmEntry *shm_entries = NULL;
+
+uint64_t shm_key_hash(uint64_t scope, const std::string& realm, const std::string& username) {
+  uint64_t hash = key_hash(realm, username) ^ scope;
+  // zero marks an empty slot
+  return hash == 0 ? 1 : hash;
+}
+
+// maps the segment, creating and sizing it if we are the first process to need it
+bool open_segment(int slots) {
+  std::string name = user_object_name(shm_cache_name);
+  bool created = true;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST) {
+    created = false;
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  }
+  if(fd < 0) {
+    LOG(kLogWarning) << "Could not open shared memory cache: " << ErrnoString(errno);
+    return false;
+  }
+  struct stat owner;
+  if(fstat(fd, &owner) != 0 || !trusted_owner(owner.st_uid, owner.st_mode)) {
+    LOG(kLogErr) << "Shared memory cache " << name << " belongs to another user or can be opened by others, not using it";
+    close(fd);
+    return false;
+  }
+
+  size_t size = 0;
+  if(created) {
+    size = sizeof(ShmHeader) + sizeof(ShmEntry) * slots;
+    if(ftruncate(fd, size) != 0) {
+      LOG(kLogWarning) << "Could not size shared memory cache: " << ErrnoString(errno);
+      close(fd);
+      shm_unlink(name.c_str());
+      return false;
+    }
+  } else {
+    // wait for the creator to size it
+    struct stat st;
+    for(int i = 0; i < 100; i++) {
+      if(fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(ShmHeader)) {
+        size = st.st_size;
+        break;
+      }
+      usleep(1000);
+    }
+    if(size == 0) {
+      LOG(kLogWarning) << "Shared memory cache was never initialised, not using it";
+      close(fd);
+      return false;
+    }
+  }
+
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    LOG(kLogWarning) << "Could not map shared memory cache: " << ErrnoString(errno);
+    return false;
+  }
+
+  ShmHeader *header = (ShmHeader*)addr;
+  if(created) {
+    // a fresh segment is zero filled, so every entry already has an even seq and no key
+    header->slots = slots;
+    header->magic.store(SHM_CACHE_MAGIC, std::memory_order_release);
+  } else {
+    for(int i = 0; i < 100 && header->magic.load(std::memory_order_acquire) != SHM_CACHE_MAGIC; i++) {
+      usleep(1000);
+    }
+    if(header->magic.load(std::memory_order_acquire) != SHM_CACHE_MAGIC ||
+       sizeof(ShmHeader) + sizeof(ShmEntry) * header->slots > size) {
+      LOG(kLogWarning) << "Shared memory cache has an unexpected layout, not using it";
+      munmap(addr, size);
+      return false;
+    }
+  }
+
+  shm_header = header;
+  shm_entries = (ShmEntry*)((char*)addr + sizeof(ShmHeader));
+  LOG(kLogInfo) << "Using shared memory cache with " << header->slots << " slots";
+  return true;
+}
+
+// maps the segment on first use, after which callers only need to look at shm_tried
+bool map_segment(int slots) {
+  if(shm_tried.load(std::memory_order_acquire)) {
+    return shm_entries != NULL;
+  }
+  std::lock_guard<std::mutex> lock(shm_mutex);
+  if(!shm_tried.load(std::memory_order_relaxed)) {
+    open_segment(slots);
+    shm_tried.store(true, std::memory_order_release);
+  }
+  return shm_entries != NULL;
+}
+
+bool fits(const std::string& value, size_t field_size) {
+  return value.length() < field_size;
+}
+
+void shm_cache_set_name(const std::string& name) {
+  shm_cache_name = name;
+}
+
+ShmCache::ShmCache(int p_slots, const std::string& p_scope) {
+  slots = p_slots;
+  scope = key_hash(p_scope, "");
+}
+
+bool ShmCache::get(const std::string& realm, const std::string& username, CacheRecord& record) {
+  if(slots <= 0 || !map_segment(slots)) {
+    return false;
+  }
+  uint64_t hash = shm_key_hash(scope, realm, username);
+  uint32_t count = shm_header->slots;
+
+  for(int probe = 0; probe < SHM_PROBE_LIMIT; probe++) {
+    ShmEntry *entry = &shm_entries[(hash + probe) % count];
+    ShmEntry copy;
+    bool stable = false;
+    for(int attempt = 0; attempt < 4 && !stable; attempt++) {
+      uint32_t before = entry->seq.load(std::memory_order_acquire);
+      if(before & 1) {
+        // being written right now
+        continue;
+      }
+      copy.timestamp = entry->timestamp;
+      copy.key_hash = entry->key_hash;
+      copy.scope = entry->scope;
+      copy.salted = entry->salted;
+      copy.account = entry->account;
+      copy.expires_at = entry->expires_at;
+      memcpy(copy.realm, entry->realm, sizeof(copy.realm));
+      memcpy(copy.username, entry->username, sizeof(copy.username));
+      memcpy(copy.password, entry->password, sizeof(copy.password));
+      memcpy(copy.salt, entry->salt, sizeof(copy.salt));
+      memcpy(copy.groups, entry->groups, sizeof(copy.groups));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      stable = entry->seq.load(std::memory_order_relaxed) == before;
+    }
+    if(!stable) {
+      // don't wait on a busy entry, if it was ours this lookup is a miss
+      continue;
+    }
+    if(copy.key_hash == 0) {
+      // empty slot, so the key is not further along the probe sequence
+      return false;
+    }
+    if(copy.key_hash != hash) {
+      continue;
+    }
+    // the copies may be torn strings if a writer raced us, so terminate them before comparing
+    copy.realm[sizeof(copy.realm) - 1] = '\0';
+    copy.username[sizeof(copy.username) - 1] = '\0';
+    copy.password[sizeof(copy.password) - 1] = '\0';
+    copy.salt[sizeof(copy.salt) - 1] = '\0';
+    copy.groups[sizeof(copy.groups) - 1] = '\0';
+    if(copy.scope != scope || realm.compare(copy.realm) != 0 || username.compare(copy.username) != 0) {
+      continue;
+    }
+    record.password = copy.password;
+    record.salt = copy.salt;
+    record.salted = copy.salted != 0;
+    record.timestamp = copy.timestamp;
+    record.account_known = (copy.account & ACCOUNT_KNOWN) != 0;
+    record.enabled = (copy.account & ACCOUNT_ENABLED) != 0 || !record.account_known;
+    record.expires_at = copy.expires_at;
+    record.groups = copy.groups;
+    return true;
+  }
+  return false;
+}
+
+bool ShmCache::put(const std::string& realm, const std::string& username, const CacheRecord& record) {
+  if(slots <= 0) {
+    return false;
+  }
+  if(!fits(realm, sizeof(ShmEntry::realm)) || !fits(username, sizeof(ShmEntry::username)) ||
+     !fits(record.password, sizeof(ShmEntry::password)) || !fits(record.salt, sizeof(ShmEntry::salt)) ||
+     !fits(record.groups, sizeof(ShmEntry::groups))) {
+    LOG(kLogInfo) << "Record too large for shared memory cache, only using sqlite";
+    // an older entry for the user would otherwise still be found
+    remove(realm, username);
+    return false;
+  }
+  if(!map_segment(slots)) {
+    return false;
+  }
+  uint64_t hash = shm_key_hash(scope, realm, username);
+  uint32_t count = shm_header->slots;
+
+  // use the slot which already has this key, otherwise the first empty one, otherwise the oldest
+  ShmEntry *target = NULL;
+  ShmEntry *oldest = NULL;
+  for(int probe = 0; probe < SHM_PROBE_LIMIT; probe++) {
+    ShmEntry *entry = &shm_entries[(hash + probe) % count];
+    if(entry->key_hash == hash || entry->key_hash == 0) {
+      target = entry;
+      break;
+    }
+    if(oldest == NULL || entry->timestamp < oldest->timestamp) {
+      oldest = entry;
+    }
+  }
+  if(target == NULL) {
+    target = oldest;
+  }
+
+  // take the entry by moving seq from even to odd, if another writer has it we skip the update and the caller
+  // removes the key instead, so whatever the other writer leaves is not taken as current
+  uint32_t seq = target->seq.load(std::memory_order_relaxed);
+  if((seq & 1) || !target->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  target->key_hash = hash;
+  target->scope = scope;
+  target->timestamp = record.timestamp;
+  target->salted = record.salted ? 1 : 0;
+  target->account = (record.account_known ? ACCOUNT_KNOWN : 0) | (record.enabled ? ACCOUNT_ENABLED : 0);
+  target->expires_at = record.expires_at;
+  strncpy(target->realm, realm.c_str(), sizeof(target->realm));
+  strncpy(target->username, username.c_str(), sizeof(target->username));
+  strncpy(target->password, record.password.c_str(), sizeof(target->password));
+  strncpy(target->salt, record.salt.c_str(), sizeof(target->salt));
+  strncpy(target->groups, record.groups.c_str(), sizeof(target->groups));
+  target->seq.store(seq + 2, std::memory_order_release);
+  return true;
+}
+
+// takes an entry, waiting for any other writer to finish rather than skipping it, returns the even seq it had
+// or false if the entry stayed busy for SHM_REMOVE_WAIT_US
+bool own_entry(ShmEntry *entry, uint32_t& seq) {
+  for(int attempt = 0; ; attempt++) {
+    seq = entry->seq.load(std::memory_order_relaxed);
+    if(!(seq & 1) && entry->seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+      return true;
+    }
+    // writers only hold an entry for a copy, so yield a few times before sleeping
+    if(attempt < 100) {
+      sched_yield();
+    } else if((attempt - 100) * 100 < SHM_REMOVE_WAIT_US) {
+      usleep(100);
+    } else {
+      return false;
+    }
+  }
+}
+
+void ShmCache::remove(const std::string& realm, const std::string& username) {
+  if(slots <= 0 || !map_segment(slots)) {
+    return;
+  }
+  uint64_t hash = shm_key_hash(scope, realm, username);
+  uint32_t count = shm_header->slots;
+
+  // every slot the key could be in is taken in turn, including ones being written right now, since a writer
+  // holding a slot may be putting an older copy of this user there
+  for(int probe = 0; probe < SHM_PROBE_LIMIT; probe++) {
+    ShmEntry *entry = &shm_entries[(hash + probe) % count];
+    uint32_t seq;
+    if(!own_entry(entry, seq)) {
+      LOG(kLogWarning) << "Shared memory cache entry stayed busy, its writer may have died";
+      continue;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    bool ours = entry->key_hash == hash;
+    if(ours) {
+      // keep the key in place so probe sequences running through this slot are not broken
+      entry->timestamp = 0;
+      memset(entry->password, 0, sizeof(entry->password));
+    }
+    entry->seq.store(seq + 2, std::memory_order_release);
+    if(!ours && entry->key_hash == 0) {
+      // empty slot, so the key is not further along the probe sequence
+      return;
+    }
+  }
+}
+
+void ShmCache::remove_realm(const std::string& realm) {
+  if(slots <= 0 || !map_segment(slots)) {
+    return;
+  }
+  for(uint32_t i = 0; i < shm_header->slots; i++) {
+    ShmEntry *entry = &shm_entries[i];
+    uint32_t seq;
+    if(!own_entry(entry, seq)) {
+      LOG(kLogWarning) << "Shared memory cache entry stayed busy, its writer may have died";
+      continue;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    if(entry->key_hash != 0 && entry->scope == scope && strncmp(entry->realm, realm.c_str(), sizeof(entry->realm)) == 0) {
+      entry->timestamp = 0;
+      memset(entry->password, 0, sizeof(entry->password));
+    }
+    entry->seq.store(seq + 2, std::memory_order_release);
+  }
+}
\ No newline at end of file
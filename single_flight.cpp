@@ -0,0 +1,117 @@
+#include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "SingleFlight.h"
+#include "KeyHash.h"
+#include "Log.h"
+
+// byte ranges in the folder's lock file, users sharing one just wait for each other's lookups
+const int FLIGHT_LOCK_SLOTS = 4096;
+
+// an in-process lookup which other threads can wait on
+struct Flight {
+  std::mutex lock;
+  std::condition_variable cv;
+  bool done;
+  pid_t pid;
+};
+
+// flights in progress, keyed by realm and username, never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::mutex flights_mutex;
+static std::map<std::string, std::shared_ptr<Flight>>& flights = *new std::map<std::string, std::shared_ptr<Flight>>();
+
+SingleFlight::SingleFlight(std::string directory, std::string realm, std::string username, int p_wait_ms) {
+  key = realm + '\n' + username;
+  // one file per folder, so made up usernames cannot fill the folder with lock files
+  lock_path = directory + "/flight.lock";
+  lock_slot = key_hash(realm, username) % FLIGHT_LOCK_SLOTS;
+  wait_ms = p_wait_ms;
+  leader = false;
+  lock_fd = -1;
+}
+
+// locks one byte of the file without waiting, open file description locks are used so each SingleFlight owns
+// its lock even when threads of one process share the file, and closing the descriptor releases it
+bool lock_slot_of(int fd, int slot) {
+  struct flock range;
+  memset(&range, 0, sizeof(range));
+  range.l_type = F_WRLCK;
+  range.l_whence = SEEK_SET;
+  range.l_start = slot;
+  range.l_len = 1;
+  return fcntl(fd, F_OFD_SETLK, &range) == 0;
+}
+
+bool SingleFlight::join() {
+  if(wait_ms <= 0) {
+    return false;
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+
+  // first see if another thread in this process is already looking the user up
+  {
+    std::unique_lock<std::mutex> lock(flights_mutex);
+    auto found = flights.find(key);
+    if(found != flights.end() && found->second->pid == getpid()) {
+      std::shared_ptr<Flight> other = found->second;
+      lock.unlock();
+      LOG(kLogInfo) << "Waiting for lookup already in progress in this process";
+      std::unique_lock<std::mutex> flight_lock(other->lock);
+      other->cv.wait_until(flight_lock, deadline, [&other] { return other->done; });
+      return true;
+    }
+    // we lead in this process, anyone else arriving now waits for us
+    flight = std::make_shared<Flight>();
+    flight->done = false;
+    flight->pid = getpid();
+    flights[key] = flight;
+    leader = true;
+  }
+
+  // then make sure no other process is doing the same
+  lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(lock_fd < 0) {
+    LOG(kLogWarning) << "Could not open lock file " << lock_path << ", not coalescing lookups";
+    return false;
+  }
+  if(lock_slot_of(lock_fd, lock_slot)) {
+    return false;
+  }
+  LOG(kLogInfo) << "Waiting for lookup already in progress in another process";
+  while(std::chrono::steady_clock::now() < deadline) {
+    usleep(5000);
+    if(lock_slot_of(lock_fd, lock_slot)) {
+      // the other process has finished, we hold the lock now in case we still need to do the lookup
+      return true;
+    }
+  }
+  LOG(kLogInfo) << "Gave up waiting for other process";
+  close(lock_fd);
+  lock_fd = -1;
+  return true;
+}
+
+SingleFlight::~SingleFlight() {
+  if(lock_fd >= 0) {
+    // closing the file releases the lock
+    close(lock_fd);
+  }
+  if(leader) {
+    {
+      std::lock_guard<std::mutex> lock(flights_mutex);
+      auto found = flights.find(key);
+      if(found != flights.end() && found->second == flight) {
+        flights.erase(found);
+      }
+    }
+    std::lock_guard<std::mutex> flight_lock(flight->lock);
+    flight->done = true;
+    flight->cv.notify_all();
+  }
+}
\ No newline at end of file
@@ -0,0 +1,110 @@
+// pam-dynamo-snapshot, exports users from the table into a snapshot file for the module's snapshot= setting
+//
+// usage: pam-dynamo-snapshot REGION TABLE SNAPSHOT_FILE [REALM ...] [name=value ...]
+//
+// with no realms the whole table is read with Scan, otherwise each realm is read with Query, the file is replaced
+// atomically so it can be rerun (e.g. from cron) while the module is using the previous snapshot
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <string.h>
+
+#include <aws/core/Aws.h>
+#include <aws/dynamodb/DynamoDBClient.h>
+#include <aws/dynamodb/model/AttributeValue.h>
+#include <aws/dynamodb/model/ScanRequest.h>
+
+#include "DynamoBackend.h"
+#include "DynamoClients.h"
+#include "Log.h"
+#include "Options.h"
+#include "SnapshotBackend.h"
+
+typedef Aws::Map<Aws::String, Aws::DynamoDB::Model::AttributeValue> Item;
+
+std::string item_string(const Item& item, const char *name) {
+  auto value = item.find(name);
+  if(value == item.end()) {
+    return std::string();
+  }
+  Aws::String s = value->second.GetS();
+  return std::string(s.c_str(), s.size());
+}
+
+bool scan_table(Aws::DynamoDB::DynamoDBClient& client, const std::string& table, std::vector<SnapshotRecord>& records) {
+  Item start_key;
+  do {
+    Aws::DynamoDB::Model::ScanRequest req;
+    req.SetTableName(Aws::String(table.c_str()));
+    project_user_attributes(req, "realm, #user");
+    if(!start_key.empty()) {
+      req.SetExclusiveStartKey(start_key);
+    }
+    const Aws::DynamoDB::Model::ScanOutcome& result = client.Scan(req);
+    if(!result.IsSuccess()) {
+      std::cerr << "Failed to scan table=" << table << ", error message=" << result.GetError().GetMessage() << std::endl;
+      return false;
+    }
+    for(const Item& item : result.GetResult().GetItems()) {
+      SnapshotRecord r;
+      r.realm = item_string(item, "realm");
+      r.username = item_string(item, "user");
+      if(!r.realm.empty() && !r.username.empty() && item_to_record(item, r.record)) {
+        records.push_back(r);
+      }
+    }
+    start_key = result.GetResult().GetLastEvaluatedKey();
+  } while(!start_key.empty());
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 4) {
+    std::cerr << "usage: " << argv[0] << " REGION TABLE SNAPSHOT_FILE [REALM ...] [name=value ...]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-snapshot", LOG_USER, LOG_PID | LOG_PERROR);
+
+  std::string region(argv[1]);
+  std::string table(argv[2]);
+  std::string path(argv[3]);
+
+  std::vector<std::string> realms;
+  int first_option = 4;
+  while(first_option < argc && strchr(argv[first_option], '=') == NULL) {
+    realms.push_back(argv[first_option++]);
+  }
+  Options opts;
+  parse_options(argc, argv, first_option, opts);
+  log_set_level(opts.log_level);
+
+  std::shared_ptr<Aws::DynamoDB::DynamoDBClient> client = get_dynamo_client(region, opts.backend_timeout_ms, opts.endpoint_for(region));
+  std::vector<SnapshotRecord> records;
+  if(realms.empty()) {
+    if(!scan_table(*client, table, records)) {
+      return 1;
+    }
+  }
+  for(const std::string& realm : realms) {
+    std::vector<std::pair<std::string, CacheRecord>> users;
+    if(!query_realm(*client, table, realm, users)) {
+      return 1;
+    }
+    for(const auto& user : users) {
+      records.push_back(SnapshotRecord{ realm, user.first, user.second });
+    }
+  }
+
+  size_t skipped = 0;
+  if(!write_snapshot(path, records, skipped)) {
+    std::cerr << "Could not write snapshot to " << path << ", check syslog for details" << std::endl;
+    return 1;
+  }
+  if(skipped > 0) {
+    std::cerr << "Left out " << skipped << " users whose fields are too long for a snapshot, they will be looked up in the table" << std::endl;
+  }
+  std::cout << "Wrote " << records.size() - skipped << " users to " << path << std::endl;
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include <iostream>
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SnapshotBackend.h"
+#include "Log.h"
+
+const char SNAPSHOT_MAGIC[8] = { 'P', 'D', 'S', 'N', 'A', 'P', '\0', '\0' };
+const uint32_t SNAPSHOT_VERSION = 2;
+
+// layout of the file, a header followed by entries sorted on (realm, username)
+// the two key fields are adjacent and zero padded, so comparing them as one block of bytes sorts on realm then username
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t count;
+  int64_t created;
+  char reserved[32];
+};
+
+struct SnapshotEntry {
+  char realm[64];
+  char username[128];
+  char password[72];
+  char salt[72];
+  uint8_t salted;
+  uint8_t enabled;
+  uint8_t reserved[6];
+  int64_t expires_at;
+  char groups[128];
+};
+
+const size_t SNAPSHOT_KEY_SIZE = sizeof(SnapshotEntry::realm) + sizeof(SnapshotEntry::username);
+static_assert(offsetof(SnapshotEntry, username) == sizeof(SnapshotEntry::realm), "key fields must be adjacent");
+
+// a mapped snapshot and the file it came from, unmapped when the last lookup using it lets go
+struct SnapshotMap {
+  void *addr;
+  size_t size;
+  const SnapshotEntry *entries;
+  uint64_t count;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+
+  ~SnapshotMap() {
+    munmap(addr, size);
+  }
+};
+
+// mapped snapshots by path, never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::mutex snapshot_mutex;
+static std::map<std::string, std::shared_ptr<SnapshotMap>>& snapshots = *new std::map<std::string, std::shared_ptr<SnapshotMap>>();
+
+std::shared_ptr<SnapshotMap> map_snapshot(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) {
+    LOG(kLogWarning) << "Could not open snapshot " << path << ": " << ErrnoString(errno);
+    return nullptr;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    LOG(kLogWarning) << "Snapshot " << path << " is too small to be valid";
+    close(fd);
+    return nullptr;
+  }
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    LOG(kLogWarning) << "Could not map snapshot " << path << ": " << ErrnoString(errno);
+    return nullptr;
+  }
+
+  std::shared_ptr<SnapshotMap> map = std::make_shared<SnapshotMap>();
+  map->addr = addr;
+  map->size = st.st_size;
+  const SnapshotHeader *header = (const SnapshotHeader*)addr;
+  if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+     header->entry_size != sizeof(SnapshotEntry) ||
+     header->count > (map->size - sizeof(SnapshotHeader)) / sizeof(SnapshotEntry)) {
+    LOG(kLogWarning) << "Snapshot " << path << " has an unexpected layout, not using it";
+    return nullptr;
+  }
+  map->entries = (const SnapshotEntry*)((const char*)addr + sizeof(SnapshotHeader));
+  map->count = header->count;
+  map->dev = st.st_dev;
+  map->ino = st.st_ino;
+  map->mtime = st.st_mtime;
+  // lookups jump around the file
+  madvise(addr, map->size, MADV_RANDOM);
+  LOG(kLogInfo) << "Mapped snapshot " << path << " with " << map->count << " users, created=" << header->created;
+  return map;
+}
+
+// returns the current mapping of path, remapping it if the file has been replaced since
+std::shared_ptr<SnapshotMap> get_snapshot(const std::string& path) {
+  struct stat st;
+  bool exists = stat(path.c_str(), &st) == 0;
+  std::lock_guard<std::mutex> lock(snapshot_mutex);
+  std::shared_ptr<SnapshotMap>& map = snapshots[path];
+  if(map && exists && map->dev == st.st_dev && map->ino == st.st_ino && map->mtime == st.st_mtime) {
+    return map;
+  }
+  map = exists ? map_snapshot(path) : nullptr;
+  return map;
+}
+
+// copies value into a zero padded field, returns false if it does not fit with a terminator
+bool copy_field(char *field, size_t field_size, const std::string& value) {
+  if(value.length() >= field_size) {
+    return false;
+  }
+  memset(field, 0, field_size);
+  memcpy(field, value.data(), value.length());
+  return true;
+}
+
+bool entry_less(const SnapshotEntry& a, const SnapshotEntry& b) {
+  return memcmp(a.realm, b.realm, SNAPSHOT_KEY_SIZE) < 0;
+}
+
+SnapshotBackend::SnapshotBackend(std::string p_path, std::shared_ptr<CredentialBackend> p_fallback) {
+  path = p_path;
+  fallback = p_fallback;
+}
+
+int SnapshotBackend::fetch(const std::string& realm, const std::string& username, CacheRecord& record) {
+  std::shared_ptr<SnapshotMap> map = get_snapshot(path);
+  SnapshotEntry key;
+  if(map && copy_field(key.realm, sizeof(key.realm), realm) && copy_field(key.username, sizeof(key.username), username)) {
+    const SnapshotEntry *end = map->entries + map->count;
+    const SnapshotEntry *found = std::lower_bound(map->entries, end, key, entry_less);
+    if(found != end && memcmp(found->realm, key.realm, SNAPSHOT_KEY_SIZE) == 0) {
+      LOG(kLogInfo) << "User found in snapshot";
+      record.password = std::string(found->password, strnlen(found->password, sizeof(found->password)));
+      record.salt = std::string(found->salt, strnlen(found->salt, sizeof(found->salt)));
+      record.salted = found->salted != 0;
+      record.account_known = true;
+      record.enabled = found->enabled != 0;
+      record.expires_at = found->expires_at;
+      record.groups = std::string(found->groups, strnlen(found->groups, sizeof(found->groups)));
+      record.timestamp = (int)time(NULL);
+      return FETCH_FOUND;
+    }
+    LOG(kLogDebug) << "User not in snapshot";
+  }
+  if(fallback) {
+    return fallback->fetch(realm, username, record);
+  }
+  return map ? FETCH_NOT_FOUND : FETCH_ERROR;
+}
+
+bool write_snapshot(const std::string& path, const std::vector<SnapshotRecord>& records, size_t& skipped) {
+  std::vector<SnapshotEntry> entries;
+  entries.reserve(records.size());
+  skipped = 0;
+  for(const SnapshotRecord& r : records) {
+    SnapshotEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    if(!copy_field(entry.realm, sizeof(entry.realm), r.realm) || !copy_field(entry.username, sizeof(entry.username), r.username) ||
+       !copy_field(entry.password, sizeof(entry.password), r.record.password) || !copy_field(entry.salt, sizeof(entry.salt), r.record.salt) ||
+       !copy_field(entry.groups, sizeof(entry.groups), r.record.groups)) {
+      skipped++;
+      continue;
+    }
+    entry.salted = r.record.salted ? 1 : 0;
+    entry.enabled = r.record.enabled ? 1 : 0;
+    entry.expires_at = r.record.expires_at;
+    entries.push_back(entry);
+  }
+  std::sort(entries.begin(), entries.end(), entry_less);
+  // a key should only appear once, keep the first
+  entries.erase(std::unique(entries.begin(), entries.end(), [](const SnapshotEntry& a, const SnapshotEntry& b) {
+    return memcmp(a.realm, b.realm, SNAPSHOT_KEY_SIZE) == 0;
+  }), entries.end());
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.entry_size = sizeof(SnapshotEntry);
+  header.count = entries.size();
+  header.created = time(NULL);
+
+  // write a temporary file next to the snapshot and rename it over, so readers see the old file or the new one
+  // the file holds password hashes, so only the owner can read it
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0) {
+    LOG(kLogErr) << "Could not create " << tmp_path << ": " << ErrnoString(errno);
+    return false;
+  }
+  bool written = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+  const char *data = (const char*)entries.data();
+  size_t left = entries.size() * sizeof(SnapshotEntry);
+  while(written && left > 0) {
+    ssize_t n = write(fd, data, left);
+    written = n > 0;
+    if(written) {
+      data += n;
+      left -= n;
+    }
+  }
+  written = written && fsync(fd) == 0;
+  close(fd);
+  if(!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG(kLogErr) << "Could not write snapshot " << path << ": " << ErrnoString(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
\ No newline at end of file
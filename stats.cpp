@@ -0,0 +1,192 @@
+#include <iostream>
+#include <errno.h>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Stats.h"
+#include "Log.h"
+
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+static std::string& stats_name = *new std::string("/pam-dynamo-stats");
+const uint32_t STATS_MAGIC = 0x50445334; // PDS4, change if the layout below changes
+
+// every value is only ever added to, so plain relaxed atomics are enough
+struct StatsSegment {
+  std::atomic<uint32_t> magic;
+  uint32_t size;
+  std::atomic<uint64_t> counters[STAT_COUNTER_COUNT];
+  std::atomic<uint64_t> buckets[STAGE_COUNT][kStatBuckets];
+  std::atomic<uint64_t> sum_ns[STAGE_COUNT];
+};
+
+std::atomic<bool> stats_enabled(false);
+thread_local int stats_call_enabled = -1;
+
+static std::mutex stats_mutex;
+static std::atomic<bool> stats_tried(false);
+static StatsSegment *stats = NULL;
+static bool stats_writable = false;
+
+static const char *counter_names[STAT_COUNTER_COUNT] = {
+  "cache_hit", "cache_miss", "process_hit", "process_miss", "cache_negative", "stale_served", "coalesced",
+  "backend_found", "backend_not_found", "backend_error", "backend_hedged", "rate_limited", "auth_success", "auth_failure"
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+  "authenticate", "hash", "cache_open", "cache_lookup", "backend", "cache_write"
+};
+
+const char *stat_counter_name(int counter) {
+  return counter_names[counter];
+}
+
+const char *stat_stage_name(int stage) {
+  return stage_names[stage];
+}
+
+// maps the segment, creating it if asked to and we are the first
+// it holds no secrets so anyone may read it, but only the creator's user can write to it
+StatsSegment *map_stats(bool create, bool& writable) {
+  bool created = false;
+  int fd = -1;
+  if(create) {
+    fd = shm_open(stats_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    created = fd >= 0;
+  }
+  if(fd < 0) {
+    fd = shm_open(stats_name.c_str(), O_RDWR, 0644);
+  }
+  writable = fd >= 0;
+  if(fd < 0 && !create) {
+    fd = shm_open(stats_name.c_str(), O_RDONLY, 0644);
+  }
+  if(fd < 0) {
+    LOG(kLogInfo) << "Could not open stats segment: " << ErrnoString(errno);
+    return NULL;
+  }
+  if(created && ftruncate(fd, sizeof(StatsSegment)) != 0) {
+    LOG(kLogWarning) << "Could not size stats segment: " << ErrnoString(errno);
+    close(fd);
+    shm_unlink(stats_name.c_str());
+    return NULL;
+  }
+  struct stat st;
+  for(int i = 0; i < 100 && !created && (fstat(fd, &st) != 0 || st.st_size == 0); i++) {
+    // the creator has not sized it yet
+    usleep(1000);
+  }
+  if(!created && (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(StatsSegment))) {
+    LOG(kLogWarning) << "Stats segment has an unexpected size, not using it";
+    close(fd);
+    return NULL;
+  }
+  void *addr = mmap(NULL, sizeof(StatsSegment), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+    LOG(kLogWarning) << "Could not map stats segment: " << ErrnoString(errno);
+    return NULL;
+  }
+  StatsSegment *segment = (StatsSegment*)addr;
+  if(created) {
+    // a fresh segment is zero filled
+    segment->size = sizeof(StatsSegment);
+    segment->magic.store(STATS_MAGIC, std::memory_order_release);
+  } else {
+    for(int i = 0; i < 100 && segment->magic.load(std::memory_order_acquire) != STATS_MAGIC; i++) {
+      usleep(1000);
+    }
+    if(segment->magic.load(std::memory_order_acquire) != STATS_MAGIC || segment->size != sizeof(StatsSegment)) {
+      LOG(kLogWarning) << "Stats segment has an unexpected layout, not using it";
+      munmap(addr, sizeof(StatsSegment));
+      return NULL;
+    }
+  }
+  return segment;
+}
+
+StatsSegment *get_stats(bool create) {
+  if(stats_tried.load(std::memory_order_acquire)) {
+    return stats;
+  }
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  if(!stats_tried.load(std::memory_order_relaxed)) {
+    stats = map_stats(create, stats_writable);
+    // a reader which found no segment tries again next time, a writer gives up so a failure costs nothing
+    stats_tried.store(create || stats != NULL, std::memory_order_release);
+  }
+  return stats;
+}
+
+void stats_set_name(const std::string& name) {
+  stats_name = name;
+}
+
+void stats_set_enabled(bool enabled) {
+  stats_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void stat_add(StatCounter counter) {
+  if(!stats_active()) {
+    return;
+  }
+  StatsSegment *segment = get_stats(true);
+  if(segment != NULL && stats_writable) {
+    segment->counters[counter].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void stat_record(StatStage stage, uint64_t ns) {
+  if(!stats_active()) {
+    return;
+  }
+  StatsSegment *segment = get_stats(true);
+  if(segment == NULL || !stats_writable) {
+    return;
+  }
+  // smallest power of two microseconds above the duration
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while(bucket < kStatBuckets - 1 && us >= (1ULL << bucket)) {
+    bucket++;
+  }
+  segment->buckets[stage][bucket].fetch_add(1, std::memory_order_relaxed);
+  segment->sum_ns[stage].fetch_add(ns, std::memory_order_relaxed);
+}
+
+bool stats_read(StatsSnapshot& snapshot) {
+  StatsSegment *segment = get_stats(false);
+  if(segment == NULL) {
+    return false;
+  }
+  for(int i = 0; i < STAT_COUNTER_COUNT; i++) {
+    snapshot.counters[i] = segment->counters[i].load(std::memory_order_relaxed);
+  }
+  for(int s = 0; s < STAGE_COUNT; s++) {
+    for(int b = 0; b < kStatBuckets; b++) {
+      snapshot.buckets[s][b] = segment->buckets[s][b].load(std::memory_order_relaxed);
+    }
+    snapshot.sum_ns[s] = segment->sum_ns[s].load(std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool stats_reset() {
+  StatsSegment *segment = get_stats(false);
+  if(segment == NULL || !stats_writable) {
+    return false;
+  }
+  for(int i = 0; i < STAT_COUNTER_COUNT; i++) {
+    segment->counters[i].store(0, std::memory_order_relaxed);
+  }
+  for(int s = 0; s < STAGE_COUNT; s++) {
+    for(int b = 0; b < kStatBuckets; b++) {
+      segment->buckets[s][b].store(0, std::memory_order_relaxed);
+    }
+    segment->sum_ns[s].store(0, std::memory_order_relaxed);
+  }
+  return true;
+}
\ No newline at end of file
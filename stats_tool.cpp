@@ -0,0 +1,109 @@
+// pam-dynamo-stats, prints the module's counters and stage latencies from the shared stats segment
+//
+// usage: pam-dynamo-stats [--prometheus | --reset]
+//
+// the values cover every process using the module on this host since the segment was created (or last reset),
+// --prometheus prints them in the Prometheus text exposition format, e.g. for node_exporter's textfile collector
+
+#include <iostream>
+#include <iomanip>
+#include <string.h>
+
+#include "Log.h"
+#include "Stats.h"
+
+// upper bound of a histogram bucket in seconds
+double bucket_bound(int bucket) {
+  return (double)(1ULL << bucket) / 1000000.0;
+}
+
+uint64_t stage_count(const StatsSnapshot& s, int stage) {
+  uint64_t count = 0;
+  for(int b = 0; b < kStatBuckets; b++) {
+    count += s.buckets[stage][b];
+  }
+  return count;
+}
+
+// upper bound in microseconds of the bucket holding the given quantile, or 0 if there are no samples
+uint64_t stage_quantile_us(const StatsSnapshot& s, int stage, double q) {
+  uint64_t count = stage_count(s, stage);
+  if(count == 0) {
+    return 0;
+  }
+  uint64_t seen = 0;
+  for(int b = 0; b < kStatBuckets; b++) {
+    seen += s.buckets[stage][b];
+    if(seen >= q * count) {
+      return 1ULL << b;
+    }
+  }
+  return 1ULL << (kStatBuckets - 1);
+}
+
+void print_text(const StatsSnapshot& s) {
+  for(int i = 0; i < STAT_COUNTER_COUNT; i++) {
+    std::cout << std::left << std::setw(20) << stat_counter_name(i) << s.counters[i] << std::endl;
+  }
+  std::cout << std::endl << std::left << std::setw(16) << "stage" << std::right << std::setw(12) << "count" << std::setw(12) << "mean_us"
+            << std::setw(12) << "p50_us<=" << std::setw(12) << "p99_us<=" << std::endl;
+  for(int stage = 0; stage < STAGE_COUNT; stage++) {
+    uint64_t count = stage_count(s, stage);
+    std::cout << std::left << std::setw(16) << stat_stage_name(stage) << std::right << std::setw(12) << count
+              << std::setw(12) << (count ? s.sum_ns[stage] / count / 1000 : 0)
+              << std::setw(12) << stage_quantile_us(s, stage, 0.5) << std::setw(12) << stage_quantile_us(s, stage, 0.99) << std::endl;
+  }
+}
+
+void print_prometheus(const StatsSnapshot& s) {
+  std::cout << "# HELP pam_dynamo_events_total Authentication outcomes across all processes on the host." << std::endl;
+  std::cout << "# TYPE pam_dynamo_events_total counter" << std::endl;
+  for(int i = 0; i < STAT_COUNTER_COUNT; i++) {
+    std::cout << "pam_dynamo_events_total{event=\"" << stat_counter_name(i) << "\"} " << s.counters[i] << std::endl;
+  }
+  std::cout << "# HELP pam_dynamo_stage_duration_seconds Time spent in each stage of authentication." << std::endl;
+  std::cout << "# TYPE pam_dynamo_stage_duration_seconds histogram" << std::endl;
+  for(int stage = 0; stage < STAGE_COUNT; stage++) {
+    const char *name = stat_stage_name(stage);
+    uint64_t cumulative = 0;
+    for(int b = 0; b < kStatBuckets - 1; b++) {
+      cumulative += s.buckets[stage][b];
+      std::cout << "pam_dynamo_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"" << bucket_bound(b) << "\"} " << cumulative << std::endl;
+    }
+    cumulative += s.buckets[stage][kStatBuckets - 1];
+    std::cout << "pam_dynamo_stage_duration_seconds_bucket{stage=\"" << name << "\",le=\"+Inf\"} " << cumulative << std::endl;
+    std::cout << "pam_dynamo_stage_duration_seconds_sum{stage=\"" << name << "\"} " << s.sum_ns[stage] / 1e9 << std::endl;
+    std::cout << "pam_dynamo_stage_duration_seconds_count{stage=\"" << name << "\"} " << cumulative << std::endl;
+  }
+}
+
+int main(int argc, const char **argv) {
+  bool prometheus = argc > 1 && strcmp(argv[1], "--prometheus") == 0;
+  bool reset = argc > 1 && strcmp(argv[1], "--reset") == 0;
+  if(argc > 2 || (argc > 1 && !prometheus && !reset)) {
+    std::cerr << "usage: " << argv[0] << " [--prometheus | --reset]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-stats", LOG_USER, LOG_PID | LOG_PERROR);
+  log_set_level(LOG_WARNING);
+
+  if(reset) {
+    if(!stats_reset()) {
+      std::cerr << "Could not reset the stats, is the module in use and are we running as its user?" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  StatsSnapshot snapshot;
+  if(!stats_read(snapshot)) {
+    std::cerr << "No stats yet, the module creates them on its first authentication" << std::endl;
+    return 1;
+  }
+  if(prometheus) {
+    print_prometheus(snapshot);
+  } else {
+    print_text(snapshot);
+  }
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,460 @@
+// pam-dynamo-streamd, keeps the local caches in step with the user table using its DynamoDB stream
+//
+// usage: pam-dynamo-streamd REGION TABLE CACHE_FOLDER [--endpoint URL] [--stream-arn ARN] [--replay FILE] [name=value ...]
+//
+// the table needs a stream with NEW_IMAGE or NEW_AND_OLD_IMAGES, changed users have their cached hash and salt
+// replaced and removed users are dropped from the cache, realms with no cache database on this host are ignored
+// the last record applied from each shard is kept in CACHE_FOLDER/streamd_<TABLE>.checkpoint and reading carries
+// on from there after a restart or an expired iterator, when that is not possible (the first start, a checkpoint
+// for another stream or older than the stream keeps records, or records trimmed before we read them) every realm
+// cached in the folder is flushed, since changes may have been missed
+// --endpoint points at something other than AWS e.g. DynamoDB Local, --replay applies stream records from a file
+// (one JSON record per line, as returned by GetRecords) instead of reading the stream, which is handy for testing
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <aws/dynamodb/DynamoDBClient.h>
+#include <aws/dynamodb/model/DescribeTableRequest.h>
+#include <aws/dynamodbstreams/DynamoDBStreamsClient.h>
+#include <aws/dynamodbstreams/model/DescribeStreamRequest.h>
+#include <aws/dynamodbstreams/model/GetShardIteratorRequest.h>
+#include <aws/dynamodbstreams/model/GetRecordsRequest.h>
+#include <aws/dynamodbstreams/model/Record.h>
+
+#include "Cache.h"
+#include "DynamoClients.h"
+#include "Log.h"
+#include "Options.h"
+
+using Aws::DynamoDBStreams::Model::OperationType;
+using Aws::DynamoDBStreams::Model::ShardIteratorType;
+
+// how often to look for new shards
+const int DESCRIBE_INTERVAL = 30;
+// oldest checkpoint carried on from, streams keep records for 24 hours
+const int CHECKPOINT_MAX_AGE = 23 * 3600;
+
+static volatile sig_atomic_t running = 1;
+
+void stop(int) {
+  running = 0;
+}
+
+std::string attribute_string(const Aws::Map<Aws::String, Aws::DynamoDBStreams::Model::AttributeValue>& item, const char *name) {
+  auto found = item.find(name);
+  if(found == item.end()) {
+    return "";
+  }
+  Aws::String value = found->second.GetS();
+  return std::string(value.c_str(), value.size());
+}
+
+// applies one stream record to the cache, returns true if it touched a cache
+bool apply_record(const std::string& cache_loc, const Options& opts, const Aws::DynamoDBStreams::Model::Record& record) {
+  const Aws::DynamoDBStreams::Model::StreamRecord& change = record.GetDynamodb();
+  std::string realm = attribute_string(change.GetKeys(), "realm");
+  std::string username = attribute_string(change.GetKeys(), "user");
+  if(realm.empty() || username.empty()) {
+    LOG(kLogWarning) << "Skipping stream record without realm and user keys";
+    return false;
+  }
+
+  // the session duration only matters for reads, which we don't do
+  Cache c(realm, cache_loc, 0, opts);
+  if(!c.exists()) {
+    return false;
+  }
+
+  CacheRecord updated;
+  switch(record.GetEventName()) {
+    case OperationType::INSERT:
+    case OperationType::MODIFY:
+      if(item_to_record(change.GetNewImage(), updated)) {
+        LOG(kLogInfo) << "Updating cache for realm=" << realm << ", user=" << username;
+        c.update_user(username, updated);
+        return true;
+      }
+      // no new image in the stream (or no password in it) so we can't update, just drop the entry instead
+      LOG(kLogInfo) << "Removing from cache realm=" << realm << ", user=" << username;
+      c.remove_user(username);
+      return true;
+    case OperationType::REMOVE:
+      LOG(kLogInfo) << "Removing from cache realm=" << realm << ", user=" << username;
+      c.remove_user(username);
+      return true;
+    default:
+      return false;
+  }
+}
+
+int replay(const char *path, const std::string& cache_loc, const Options& opts) {
+  std::ifstream file(path);
+  if(!file) {
+    std::cerr << "Could not open " << path << std::endl;
+    return 1;
+  }
+  int applied = 0;
+  int skipped = 0;
+  std::string line;
+  while(running && std::getline(file, line)) {
+    if(line.empty()) {
+      continue;
+    }
+    Aws::Utils::Json::JsonValue json(Aws::String(line.c_str()));
+    if(!json.WasParseSuccessful()) {
+      std::cerr << "Skipping line which is not valid JSON: " << json.GetErrorMessage() << std::endl;
+      skipped++;
+      continue;
+    }
+    if(apply_record(cache_loc, opts, Aws::DynamoDBStreams::Model::Record(json.View()))) {
+      applied++;
+    } else {
+      skipped++;
+    }
+  }
+  std::cout << "Applied " << applied << " records, skipped " << skipped << std::endl;
+  return 0;
+}
+
+bool find_stream(const Aws::Client::ClientConfiguration& config, const std::string& table, Aws::String& stream_arn) {
+  Aws::DynamoDB::DynamoDBClient client(config);
+  Aws::DynamoDB::Model::DescribeTableRequest req;
+  req.SetTableName(Aws::String(table.c_str()));
+  const Aws::DynamoDB::DescribeTableOutcome& result = client.DescribeTable(req);
+  if(!result.IsSuccess()) {
+    std::cerr << "Failed to describe table=" << table << ", error message=" << result.GetError().GetMessage() << std::endl;
+    return false;
+  }
+  stream_arn = result.GetResult().GetTable().GetLatestStreamArn();
+  if(stream_arn.empty()) {
+    std::cerr << "Table " << table << " does not have a stream enabled" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// where we have got to in the stream, sequences holds the last sequence number applied by shard id and finished
+// the shards read to the end
+struct Checkpoint {
+  std::map<Aws::String, Aws::String> sequences;
+  std::set<Aws::String> finished;
+};
+
+std::string checkpoint_path(const std::string& cache_loc, const std::string& table) {
+  return cache_loc + "/streamd_" + table + ".checkpoint";
+}
+
+// reads the checkpoint, false if there is none for this stream recent enough to carry on from
+bool load_checkpoint(const std::string& path, const Aws::String& stream_arn, Checkpoint& checkpoint) {
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0) {
+    LOG(kLogInfo) << "No checkpoint in " << path;
+    return false;
+  }
+  if(time(NULL) - st.st_mtime > CHECKPOINT_MAX_AGE) {
+    LOG(kLogWarning) << "Checkpoint " << path << " is older than the stream keeps records";
+    return false;
+  }
+  std::ifstream file(path);
+  std::string line;
+  if(!std::getline(file, line) || line != std::string(stream_arn.c_str(), stream_arn.size())) {
+    LOG(kLogWarning) << "Checkpoint " << path << " is for another stream";
+    return false;
+  }
+  while(std::getline(file, line)) {
+    size_t space = line.find(' ');
+    if(space == std::string::npos) {
+      continue;
+    }
+    Aws::String shard(line.substr(0, space).c_str());
+    std::string value = line.substr(space + 1);
+    if(value == "finished") {
+      checkpoint.finished.insert(shard);
+    } else {
+      checkpoint.sequences[shard] = Aws::String(value.c_str());
+    }
+  }
+  return true;
+}
+
+// written to a temporary file and renamed into place, so a crash leaves the old or the new checkpoint
+void save_checkpoint(const std::string& path, const Aws::String& stream_arn, const Checkpoint& checkpoint) {
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream file(temp, std::ios::trunc);
+    file << stream_arn << "\n";
+    for(const auto& shard : checkpoint.sequences) {
+      file << shard.first << " " << shard.second << "\n";
+    }
+    for(const auto& shard : checkpoint.finished) {
+      file << shard << " finished\n";
+    }
+    if(!file.flush()) {
+      LOG(kLogWarning) << "Could not write checkpoint " << temp;
+      return;
+    }
+  }
+  if(rename(temp.c_str(), path.c_str()) != 0) {
+    LOG(kLogWarning) << "Could not replace checkpoint " << path << ": " << ErrnoString(errno);
+  }
+}
+
+// realm from a cache file name, <realm>_cache.db or <realm>_cache_<n>.db
+bool cache_file_realm(const std::string& name, std::string& realm) {
+  size_t pos = name.rfind("_cache");
+  if(pos == std::string::npos || pos == 0 || name.length() < 3 || name.compare(name.length() - 3, 3, ".db") != 0) {
+    return false;
+  }
+  std::string shard = name.substr(pos + 6, name.length() - pos - 9);
+  if(!shard.empty() && (shard[0] != '_' || shard.length() == 1 || shard.find_first_not_of("0123456789", 1) != std::string::npos)) {
+    return false;
+  }
+  realm = name.substr(0, pos);
+  return true;
+}
+
+// drops every realm cached in the folder, for when stream records may have been missed
+void flush_caches(const std::string& cache_loc, const Options& opts) {
+  DIR *dir = opendir(cache_loc.c_str());
+  if(dir == NULL) {
+    LOG(kLogErr) << "Could not list " << cache_loc << " to flush it: " << ErrnoString(errno);
+    return;
+  }
+  std::set<std::string> realms;
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL) {
+    std::string realm;
+    if(cache_file_realm(entry->d_name, realm)) {
+      realms.insert(realm);
+    }
+  }
+  closedir(dir);
+  for(const std::string& realm : realms) {
+    LOG(kLogWarning) << "Stream records may have been missed, flushing cache for realm=" << realm;
+    Cache c(realm, cache_loc, 0, opts);
+    c.clear();
+  }
+}
+
+int follow(const Aws::Client::ClientConfiguration& config, const Aws::String& stream_arn, const std::string& cache_loc,
+           const std::string& table, const Options& opts) {
+  Aws::DynamoDBStreams::DynamoDBStreamsClient client(config);
+  std::string path = checkpoint_path(cache_loc, table);
+  Checkpoint checkpoint;
+  // without a checkpoint we cannot tell what changed while we were not reading
+  bool continuous = load_checkpoint(path, stream_arn, checkpoint);
+  // open iterators by shard id, shards we have opened since starting, and shards opened at their start which have
+  // not returned a record yet (so they can be opened there again)
+  std::map<Aws::String, Aws::String> iterators;
+  std::set<Aws::String> opened;
+  std::set<Aws::String> from_start;
+  bool first_describe = true;
+  time_t last_describe = 0;
+
+  LOG(kLogInfo) << "Following stream " << stream_arn << (continuous ? " from checkpoint" : "");
+  while(running) {
+    if(time(NULL) - last_describe >= DESCRIBE_INTERVAL) {
+      last_describe = time(NULL);
+      bool flush = false;
+      bool described = true;
+      std::set<Aws::String> seen;
+      Aws::String start_shard;
+      do {
+        Aws::DynamoDBStreams::Model::DescribeStreamRequest req;
+        req.SetStreamArn(stream_arn);
+        if(!start_shard.empty()) {
+          req.SetExclusiveStartShardId(start_shard);
+        }
+        const Aws::DynamoDBStreams::DescribeStreamOutcome& result = client.DescribeStream(req);
+        if(!result.IsSuccess()) {
+          LOG(kLogErr) << "Failed to describe stream, error message=" << result.GetError().GetMessage();
+          described = false;
+          break;
+        }
+        const Aws::DynamoDBStreams::Model::StreamDescription& description = result.GetResult().GetStreamDescription();
+        for(const auto& shard : description.GetShards()) {
+          const Aws::String& id = shard.GetShardId();
+          seen.insert(id);
+          if(iterators.count(id) > 0 || checkpoint.finished.count(id) > 0) {
+            continue;
+          }
+          bool closed = !shard.GetSequenceNumberRange().GetEndingSequenceNumber().empty();
+          if(first_describe && !continuous && closed) {
+            // older than us, and the caches are flushed below
+            checkpoint.finished.insert(id);
+            continue;
+          }
+          // carry on after the last record applied, shards we have no place in but know nothing was missed from
+          // (created since the checkpoint or since we started) are read from the beginning, anything else is read
+          // from now on and the caches flushed
+          Aws::DynamoDBStreams::Model::GetShardIteratorRequest iterator_req;
+          iterator_req.SetStreamArn(stream_arn);
+          iterator_req.SetShardId(id);
+          auto sequence = checkpoint.sequences.find(id);
+          ShardIteratorType type = ShardIteratorType::LATEST;
+          if(sequence != checkpoint.sequences.end()) {
+            type = ShardIteratorType::AFTER_SEQUENCE_NUMBER;
+            iterator_req.SetSequenceNumber(sequence->second);
+          } else if(from_start.count(id) > 0 || (opened.count(id) == 0 && (continuous || !first_describe))) {
+            type = ShardIteratorType::TRIM_HORIZON;
+          }
+          iterator_req.SetShardIteratorType(type);
+          const Aws::DynamoDBStreams::GetShardIteratorOutcome& iterator = client.GetShardIterator(iterator_req);
+          if(!iterator.IsSuccess()) {
+            LOG(kLogErr) << "Failed to get iterator for shard=" << id << ", error message=" << iterator.GetError().GetMessage();
+            if(iterator.GetError().GetExceptionName() == "TrimmedDataAccessException") {
+              // our place has been trimmed, so records after it are gone, the next describe reads from now on
+              checkpoint.sequences.erase(id);
+              from_start.erase(id);
+              opened.insert(id);
+              last_describe = 0;
+            }
+            continue;
+          }
+          iterators[id] = iterator.GetResult().GetShardIterator();
+          opened.insert(id);
+          if(type == ShardIteratorType::TRIM_HORIZON) {
+            from_start.insert(id);
+          } else if(type == ShardIteratorType::LATEST) {
+            flush = true;
+          }
+        }
+        start_shard = description.GetLastEvaluatedShardId();
+      } while(!start_shard.empty());
+      if(flush || (described && first_describe && !continuous)) {
+        // after opening the iterators, so every change is either flushed or read
+        flush_caches(cache_loc, opts);
+      }
+      if(described) {
+        // forget shards which have aged out of the stream
+        for(auto it = checkpoint.sequences.begin(); it != checkpoint.sequences.end();) {
+          it = seen.count(it->first) > 0 ? std::next(it) : checkpoint.sequences.erase(it);
+        }
+        for(auto it = checkpoint.finished.begin(); it != checkpoint.finished.end();) {
+          it = seen.count(*it) > 0 ? std::next(it) : checkpoint.finished.erase(it);
+        }
+        first_describe = false;
+        continuous = true;
+      }
+      // saved even when nothing changed, its age tells a restart whether it can carry on from it
+      save_checkpoint(path, stream_arn, checkpoint);
+    }
+
+    bool got_records = false;
+    for(auto it = iterators.begin(); running && it != iterators.end();) {
+      Aws::DynamoDBStreams::Model::GetRecordsRequest req;
+      req.SetShardIterator(it->second);
+      const Aws::DynamoDBStreams::GetRecordsOutcome& result = client.GetRecords(req);
+      if(!result.IsSuccess()) {
+        // most likely an expired iterator, the next describe opens the shard again after the last record applied
+        LOG(kLogWarning) << "Failed to read shard=" << it->first << ", error message=" << result.GetError().GetMessage();
+        if(result.GetError().GetExceptionName() == "TrimmedDataAccessException") {
+          // records we had not read yet have been trimmed
+          checkpoint.sequences.erase(it->first);
+          from_start.erase(it->first);
+        }
+        it = iterators.erase(it);
+        last_describe = 0;
+        continue;
+      }
+      for(const auto& record : result.GetResult().GetRecords()) {
+        apply_record(cache_loc, opts, record);
+        checkpoint.sequences[it->first] = record.GetDynamodb().GetSequenceNumber();
+        from_start.erase(it->first);
+        got_records = true;
+      }
+      const Aws::String& next = result.GetResult().GetNextShardIterator();
+      if(next.empty()) {
+        // the shard has been closed and we have read all of it
+        checkpoint.finished.insert(it->first);
+        checkpoint.sequences.erase(it->first);
+        it = iterators.erase(it);
+        got_records = true;
+      } else {
+        it->second = next;
+        ++it;
+      }
+    }
+    if(got_records) {
+      save_checkpoint(path, stream_arn, checkpoint);
+    } else {
+      sleep(1);
+    }
+  }
+  save_checkpoint(path, stream_arn, checkpoint);
+  return 0;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 4) {
+    std::cerr << "usage: " << argv[0] << " REGION TABLE CACHE_FOLDER [--endpoint URL] [--stream-arn ARN] [--replay FILE] [name=value ...]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-streamd", LOG_DAEMON, LOG_PID | LOG_PERROR);
+
+  std::string region(argv[1]);
+  std::string table(argv[2]);
+  std::string cache_loc(argv[3]);
+
+  const char *endpoint = NULL;
+  const char *stream_arn = NULL;
+  const char *replay_file = NULL;
+  int first_option = 4;
+  while(first_option + 1 < argc && strncmp(argv[first_option], "--", 2) == 0) {
+    if(strcmp(argv[first_option], "--endpoint") == 0) {
+      endpoint = argv[first_option + 1];
+    } else if(strcmp(argv[first_option], "--stream-arn") == 0) {
+      stream_arn = argv[first_option + 1];
+    } else if(strcmp(argv[first_option], "--replay") == 0) {
+      replay_file = argv[first_option + 1];
+    } else {
+      std::cerr << "Unknown flag " << argv[first_option] << std::endl;
+      return 2;
+    }
+    first_option += 2;
+  }
+  Options opts;
+  parse_options(argc, argv, first_option, opts);
+  opts.region = region;
+  opts.table = table;
+  log_set_level(opts.log_level);
+
+  signal(SIGTERM, stop);
+  signal(SIGINT, stop);
+
+  int ret_val = 1;
+  Aws::SDKOptions sdk_options;
+  Aws::InitAPI(sdk_options);
+  {
+    if(replay_file != NULL) {
+      ret_val = replay(replay_file, cache_loc, opts);
+    } else {
+      Aws::Client::ClientConfiguration config;
+      config.region = Aws::String(region.c_str());
+      if(endpoint != NULL) {
+        config.endpointOverride = Aws::String(endpoint);
+      }
+      Aws::String arn(stream_arn != NULL ? stream_arn : "");
+      if(!arn.empty() || find_stream(config, table, arn)) {
+        ret_val = follow(config, arn, cache_loc, table, opts);
+      }
+    }
+  }
+  Aws::ShutdownAPI(sdk_options);
+  return ret_val;
+}
@@ -0,0 +1,165 @@
+// pam-dynamo-warm, loads a realm's users into the cache before traffic arrives
+//
+// usage: pam-dynamo-warm REGION TABLE REALM CACHE_FOLDER [-u USER_FILE] [name=value ...]
+//
+// without -u every user in the realm is loaded with Query, with -u only the users listed in the file
+// (one per line, - for stdin) are loaded with BatchGetItem, the name=value settings are the same as the module's
+
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+
+#include <aws/core/Aws.h>
+#include <aws/dynamodb/DynamoDBClient.h>
+#include <aws/dynamodb/model/AttributeValue.h>
+#include <aws/dynamodb/model/BatchGetItemRequest.h>
+
+#include "Cache.h"
+#include "DynamoBackend.h"
+#include "DynamoClients.h"
+#include "Log.h"
+#include "Options.h"
+
+typedef Aws::Map<Aws::String, Aws::DynamoDB::Model::AttributeValue> Item;
+typedef std::vector<std::pair<std::string, CacheRecord>> Records;
+
+// BatchGetItem takes at most 100 keys per call
+const size_t BATCH_SIZE = 100;
+// calls made for one batch before the keys DynamoDB still has not got to are given up on
+const int BATCH_ATTEMPTS = 8;
+
+void add_item(const Item& item, Records& records) {
+  auto user = item.find("user");
+  CacheRecord record;
+  if(user != item.end() && item_to_record(item, record)) {
+    Aws::String username = user->second.GetS();
+    records.push_back(std::make_pair(std::string(username.c_str(), username.size()), record));
+  }
+}
+
+// users must not repeat, BatchGetItem rejects a request with the same key twice
+// skipped counts the users still unprocessed after BATCH_ATTEMPTS, which are also listed on stderr
+bool load_users(Aws::DynamoDB::DynamoDBClient& client, const std::string& table, const std::string& realm, const std::vector<std::string>& users,
+                Records& records, size_t& skipped) {
+  const Aws::String as_table(table.c_str());
+  for(size_t first = 0; first < users.size(); first += BATCH_SIZE) {
+    Aws::DynamoDB::Model::KeysAndAttributes keys;
+    project_user_attributes(keys, "#user");
+    for(size_t i = first; i < users.size() && i < first + BATCH_SIZE; i++) {
+      Item key;
+      key["realm"] = Aws::DynamoDB::Model::AttributeValue(Aws::String(realm.c_str()));
+      key["user"] = Aws::DynamoDB::Model::AttributeValue(Aws::String(users[i].c_str()));
+      keys.AddKeys(key);
+    }
+    Aws::Map<Aws::String, Aws::DynamoDB::Model::KeysAndAttributes> pending;
+    pending[as_table] = keys;
+
+    // keep asking for whatever DynamoDB did not get to, backing off a little each time
+    for(int attempt = 0; !pending.empty() && attempt < BATCH_ATTEMPTS; attempt++) {
+      if(attempt > 0) {
+        usleep(50000 << (attempt < 6 ? attempt : 6));
+      }
+      Aws::DynamoDB::Model::BatchGetItemRequest req;
+      req.SetRequestItems(pending);
+      const Aws::DynamoDB::Model::BatchGetItemOutcome& result = client.BatchGetItem(req);
+      if(!result.IsSuccess()) {
+        std::cerr << "Failed to read from table=" << table << ", error message=" << result.GetError().GetMessage() << std::endl;
+        return false;
+      }
+      auto responses = result.GetResult().GetResponses().find(as_table);
+      if(responses != result.GetResult().GetResponses().end()) {
+        for(const Item& item : responses->second) {
+          add_item(item, records);
+        }
+      }
+      pending = result.GetResult().GetUnprocessedKeys();
+    }
+    auto left = pending.find(as_table);
+    if(left != pending.end()) {
+      for(const Item& key : left->second.GetKeys()) {
+        auto user = key.find("user");
+        std::cerr << "Gave up reading user=" << (user != key.end() ? user->second.GetS() : "") << " after " << BATCH_ATTEMPTS << " attempts" << std::endl;
+        skipped++;
+      }
+    }
+  }
+  return true;
+}
+
+bool read_users(const char *path, std::vector<std::string>& users) {
+  std::ifstream file;
+  std::istream *in = &std::cin;
+  if(strcmp(path, "-") != 0) {
+    file.open(path);
+    if(!file) {
+      std::cerr << "Could not open " << path << std::endl;
+      return false;
+    }
+    in = &file;
+  }
+  std::string line;
+  while(std::getline(*in, line)) {
+    if(!line.empty()) {
+      users.push_back(line);
+    }
+  }
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  if(argc < 5) {
+    std::cerr << "usage: " << argv[0] << " REGION TABLE REALM CACHE_FOLDER [-u USER_FILE] [name=value ...]" << std::endl;
+    return 2;
+  }
+  log_init("pam-dynamo-warm", LOG_USER, LOG_PID | LOG_PERROR);
+
+  std::string region(argv[1]);
+  std::string table(argv[2]);
+  std::string realm(argv[3]);
+  std::string cache_loc(argv[4]);
+
+  int first_option = 5;
+  const char *user_file = NULL;
+  if(argc > 6 && strcmp(argv[5], "-u") == 0) {
+    user_file = argv[6];
+    first_option = 7;
+  }
+  Options opts;
+  parse_options(argc, argv, first_option, opts);
+  opts.region = region;
+  opts.table = table;
+  log_set_level(opts.log_level);
+
+  std::vector<std::string> users;
+  if(user_file != NULL && !read_users(user_file, users)) {
+    return 1;
+  }
+  std::sort(users.begin(), users.end());
+  users.erase(std::unique(users.begin(), users.end()), users.end());
+
+  std::shared_ptr<Aws::DynamoDB::DynamoDBClient> client = get_dynamo_client(region, opts.backend_timeout_ms, opts.endpoint_for(region));
+  Records records;
+  size_t skipped = 0;
+  bool loaded = user_file != NULL ? load_users(*client, table, realm, users, records, skipped) : query_realm(*client, table, realm, records);
+  if(!loaded) {
+    return 1;
+  }
+
+  // the session duration only matters for reads, which we don't do
+  Cache c(realm, cache_loc, 0, opts);
+  if(!c.save_many(records)) {
+    std::cerr << "Could not write to the cache in " << cache_loc << ", check syslog for details" << std::endl;
+    return 1;
+  }
+  std::cout << "Loaded " << records.size() << " users into the cache for realm " << realm << std::endl;
+  if(skipped > 0) {
+    std::cerr << skipped << " users could not be read, see above" << std::endl;
+    return 1;
+  }
+  return 0;
+}
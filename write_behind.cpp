@@ -0,0 +1,173 @@
+#include <iostream>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+#include "WriteBehind.h"
+#include "Cache.h"
+#include "Log.h"
+
+typedef std::vector<std::pair<std::string, CacheRecord>> Records;
+
+// saves waiting for one cache, and the batch the thread is writing to it right now
+struct PendingCache {
+  Cache *cache;
+  std::map<std::string, CacheRecord> queued;
+  std::map<std::string, CacheRecord> writing;
+};
+
+// never destroyed, see the note on -z nodelete in CMakeLists.txt
+struct WriteQueue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::map<std::string, PendingCache> caches;
+  size_t queued = 0;
+  bool stopping = false;
+  std::thread *worker = NULL;
+  pid_t pid = 0;
+};
+
+static WriteQueue& write_queue = *new WriteQueue();
+
+std::string queue_key(const std::string& scope, const std::string& realm) {
+  return scope + '\n' + realm;
+}
+
+void write_queued() {
+  WriteQueue& q = write_queue;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  while(true) {
+    q.cv.wait(lock, [&q] { return q.stopping || q.queued > 0; });
+    if(q.queued == 0) {
+      break;
+    }
+    // take everything queued so far, saves arriving while we write form the next batch
+    std::vector<std::pair<Cache*, Records>> batches;
+    for(auto& entry : q.caches) {
+      PendingCache& pending = entry.second;
+      if(!pending.queued.empty()) {
+        pending.writing.swap(pending.queued);
+        pending.queued.clear();
+        batches.push_back(std::make_pair(pending.cache, Records(pending.writing.begin(), pending.writing.end())));
+      }
+    }
+    q.queued = 0;
+    lock.unlock();
+
+    for(auto& batch : batches) {
+      if(!batch.first->save_many(batch.second)) {
+        LOG(kLogErr) << "Unable to write " << batch.second.size() << " queued cache entries, check previous messages";
+      } else {
+        LOG(kLogDebug) << "Wrote " << batch.second.size() << " queued cache entries";
+      }
+    }
+
+    lock.lock();
+    for(auto& entry : q.caches) {
+      entry.second.writing.clear();
+    }
+    // wakes anyone waiting in forget_queued_write
+    q.cv.notify_all();
+  }
+}
+
+bool queue_cache_write(const std::string& directory, const std::string& realm, int session_duration, const Options& opts,
+                       const std::string& username, const CacheRecord& record) {
+  WriteQueue& q = write_queue;
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if(q.pid != getpid()) {
+    // forked, the parent's thread does not exist here and the parent will write what it had queued
+    q.caches.clear();
+    q.queued = 0;
+    q.worker = NULL;
+    q.pid = getpid();
+  }
+  if(q.stopping) {
+    return false;
+  }
+
+  std::string key = queue_key(cache_scope(directory, opts), realm);
+  auto found = q.caches.find(key);
+  if(found == q.caches.end()) {
+    PendingCache pending;
+    pending.cache = new Cache(realm, directory, session_duration, opts);
+    found = q.caches.insert(std::make_pair(key, pending)).first;
+  }
+  std::map<std::string, CacheRecord>& queued = found->second.queued;
+  auto existing = queued.find(username);
+  if(existing != queued.end()) {
+    existing->second = record;
+    return true;
+  }
+  if(q.queued >= (size_t)opts.cache_write_queue) {
+    LOG(kLogInfo) << "Cache write queue is full, writing directly";
+    return false;
+  }
+  queued[username] = record;
+  q.queued++;
+
+  if(q.worker == NULL) {
+    q.worker = new std::thread(write_queued);
+  }
+  q.cv.notify_all();
+  return true;
+}
+
+// looks in one of the maps, the caller holds the queue lock
+bool find_in(const std::map<std::string, CacheRecord>& users, const std::string& username, CacheRecord& record) {
+  auto found = users.find(username);
+  if(found == users.end()) {
+    return false;
+  }
+  record = found->second;
+  return true;
+}
+
+bool find_queued_write(const std::string& scope, const std::string& realm, const std::string& username, CacheRecord& record) {
+  WriteQueue& q = write_queue;
+  std::lock_guard<std::mutex> lock(q.mutex);
+  auto found = q.caches.find(queue_key(scope, realm));
+  if(q.pid != getpid() || found == q.caches.end()) {
+    return false;
+  }
+  return find_in(found->second.queued, username, record) || find_in(found->second.writing, username, record);
+}
+
+void forget_queued_write(const std::string& scope, const std::string& realm, const std::string& username) {
+  WriteQueue& q = write_queue;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  auto found = q.caches.find(queue_key(scope, realm));
+  if(q.pid != getpid() || found == q.caches.end()) {
+    return;
+  }
+  PendingCache& pending = found->second;
+  if(pending.queued.erase(username) > 0) {
+    q.queued--;
+  }
+  // if it is being written right now let that finish, so the caller's change lands after it rather than before
+  q.cv.wait(lock, [&pending, &username] { return pending.writing.count(username) == 0; });
+}
+
+void flush_cache_writes() {
+  WriteQueue& q = write_queue;
+  std::thread *worker = NULL;
+  {
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(q.worker == NULL || q.pid != getpid()) {
+      return;
+    }
+    worker = q.worker;
+    q.stopping = true;
+    q.cv.notify_all();
+  }
+  // the thread writes whatever is left before it exits
+  worker->join();
+  delete worker;
+  std::lock_guard<std::mutex> lock(q.mutex);
+  q.worker = NULL;
+  q.stopping = false;
+}
\ No newline at end of file